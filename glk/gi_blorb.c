@@ -14,6 +14,7 @@
 
 #include "glk.h"
 #include "gi_blorb.h"
+#include <string.h> /* For memcpy(). */
 
 #ifndef NULL
 #define NULL 0
@@ -46,10 +47,14 @@ typedef struct giblorb_chunkdesc_struct {
     glui32 startpos; /* start of chunk header */
     glui32 datpos; /* start of data (either startpos or startpos+8) */
     
-    void *ptr; /* pointer to malloc'd data, if loaded */
+    void *ptr; /* pointer to malloc'd data, if loaded (never, when the 
+        file is mapped) */
     int auxdatnum; /* entry in the auxsound/auxpict array; -1 if none.
         This only applies to chunks that represent resources;  */
     
+    int refcount; /* while > 0, the chunk is not unloaded */
+    glui32 lastuse; /* value of map->usecounter when last loaded */
+    
 } giblorb_chunkdesc_t;
 
 /* giblorb_resdesc_t: Describes one resource in the Blorb file. */
@@ -64,6 +69,13 @@ struct giblorb_map_struct {
     glui32 inited; /* holds giblorb_Inited_Magic if the map structure is 
         valid */
     strid_t file;
+    unsigned char *mapped; /* the whole file, if mapped into memory; then 
+        chunks are not loaded, but point into the mapping */
+    glui32 mappedlen;
+    
+    glui32 memlimit; /* limit for loaded chunks (in bytes), or 0 */
+    glui32 memused; /* bytes used by loaded chunks */
+    glui32 usecounter; /* incremented by each load */
     
     int numchunks;
     giblorb_chunkdesc_t *chunks; /* list of chunk descriptors */
@@ -82,6 +94,12 @@ static int lib_inited = FALSE;
 
 static giblorb_err_t giblorb_initialize(void);
 static giblorb_err_t giblorb_initialize_map(giblorb_map_t *map);
+static giblorb_err_t giblorb_index_chunks(strid_t file, 
+    unsigned char *mapped, glui32 mappedlen, 
+    giblorb_chunkdesc_t **newchunks, int *newnumchunks);
+static glui32 giblorb_read(strid_t file, unsigned char *mapped, 
+    glui32 mappedlen, glui32 pos, char *buffer, glui32 len);
+static void giblorb_make_room(giblorb_map_t *map, glui32 len);
 static void giblorb_qsort(giblorb_resdesc_t **list, int len);
 static giblorb_resdesc_t *giblorb_bsearch(giblorb_resdesc_t *sample, 
     giblorb_resdesc_t **list, int len);
@@ -98,11 +116,10 @@ giblorb_err_t giblorb_create_map(strid_t file, giblorb_map_t **newmap)
 {
     giblorb_err_t err;
     giblorb_map_t *map;
-    glui32 readlen;
-    glui32 nextpos, totallength;
     giblorb_chunkdesc_t *chunks;
-    int chunks_size, numchunks;
-    char buffer[16];
+    int numchunks;
+    unsigned char *mapped;
+    glui32 mappedlen;
     
     *newmap = NULL;
     
@@ -113,11 +130,79 @@ giblorb_err_t giblorb_create_map(strid_t file, giblorb_map_t **newmap)
         lib_inited = TRUE;
     }
 
+    /* If possible, the file is mapped into memory, so that chunks 
+        do not have to be read and copied. */
+    
+    mappedlen = 0;
+    mapped = (unsigned char *)giblorb_map_stream(file, &mappedlen);
+
     /* First, chew through the file and index the chunks. */
     
-    glk_stream_set_position(file, 0, seekmode_Start);
+    err = giblorb_index_chunks(file, mapped, mappedlen, &chunks, 
+        &numchunks);
+    if (err) {
+        if (mapped)
+            giblorb_unmap_stream(file, mapped, mappedlen);
+        return err;
+    }
+    
+    /* The basic IFF structure seems to be ok, and we have a list of
+        chunks. Now we allocate the map structure itself. */
+    
+    map = (giblorb_map_t *)giblorb_malloc(sizeof(giblorb_map_t));
+    if (!map) {
+        giblorb_free(chunks);
+        if (mapped)
+            giblorb_unmap_stream(file, mapped, mappedlen);
+        return giblorb_err_Alloc;
+    }
+        
+    map->inited = giblorb_Inited_Magic;
+    map->file = file;
+    map->mapped = mapped;
+    map->mappedlen = mappedlen;
+    map->memlimit = 0;
+    map->memused = 0;
+    map->usecounter = 0;
+    map->chunks = chunks;
+    map->numchunks = numchunks;
+    map->resources = NULL;
+    map->ressorted = NULL;
+    map->numresources = 0;
+    /*map->releasenum = 0;
+    map->zheader = NULL;
+    map->resolution = NULL;
+    map->palettechunk = -1;
+    map->palette = NULL;
+    map->auxsound = NULL;
+    map->auxpict = NULL;*/
+    
+    /* Now we do everything else involved in loading the Blorb file,
+        such as building resource lists. */
+    
+    err = giblorb_initialize_map(map);
+    if (err) {
+        giblorb_destroy_map(map);
+        return err;
+    }
+    
+    *newmap = map;
+    return giblorb_err_None;
+}
+
+/* Read the list of chunks, either from the stream, or from the 
+    mapped file. */
+static giblorb_err_t giblorb_index_chunks(strid_t file, 
+    unsigned char *mapped, glui32 mappedlen, 
+    giblorb_chunkdesc_t **newchunks, int *newnumchunks)
+{
+    glui32 readlen;
+    glui32 nextpos, totallength;
+    giblorb_chunkdesc_t *chunks;
+    int chunks_size, numchunks;
+    char buffer[16];
     
-    readlen = glk_get_buffer_stream(file, buffer, 12);
+    readlen = giblorb_read(file, mapped, mappedlen, 0, buffer, 12);
     if (readlen != 12)
         return giblorb_err_Read;
     
@@ -133,17 +218,19 @@ giblorb_err_t giblorb_create_map(strid_t file, giblorb_map_t **newmap)
     numchunks = 0;
     chunks = (giblorb_chunkdesc_t *)giblorb_malloc(sizeof(giblorb_chunkdesc_t) 
         * chunks_size);
+    if (!chunks)
+        return giblorb_err_Alloc;
 
     while (nextpos < totallength) {
         glui32 type, len;
         int chunum;
         giblorb_chunkdesc_t *chu;
         
-        glk_stream_set_position(file, nextpos, seekmode_Start);
-        
-        readlen = glk_get_buffer_stream(file, buffer, 8);
-        if (readlen != 8)
+        readlen = giblorb_read(file, mapped, mappedlen, nextpos, buffer, 8);
+        if (readlen != 8) {
+            giblorb_free(chunks);
             return giblorb_err_Read;
+        }
         
         type = giblorb_native4(buffer+0);
         len = giblorb_native4(buffer+4);
@@ -170,50 +257,41 @@ giblorb_err_t giblorb_create_map(strid_t file, giblorb_map_t **newmap)
         }
         chu->ptr = NULL;
         chu->auxdatnum = -1;
+        chu->refcount = 0;
+        chu->lastuse = 0;
         
         nextpos = nextpos + len + 8;
         if (nextpos & 1)
             nextpos++;
             
-        if (nextpos > totallength)
+        if (nextpos > totallength 
+            || (mapped && (chu->datpos > mappedlen 
+                || chu->len > mappedlen - chu->datpos))) {
+            giblorb_free(chunks);
             return giblorb_err_Format;
+        }
     }
     
-    /* The basic IFF structure seems to be ok, and we have a list of
-        chunks. Now we allocate the map structure itself. */
-    
-    map = (giblorb_map_t *)giblorb_malloc(sizeof(giblorb_map_t));
-    if (!map) {
-        giblorb_free(chunks);
-        return giblorb_err_Alloc;
-    }
-        
-    map->inited = giblorb_Inited_Magic;
-    map->file = file;
-    map->chunks = chunks;
-    map->numchunks = numchunks;
-    map->resources = NULL;
-    map->ressorted = NULL;
-    map->numresources = 0;
-    /*map->releasenum = 0;
-    map->zheader = NULL;
-    map->resolution = NULL;
-    map->palettechunk = -1;
-    map->palette = NULL;
-    map->auxsound = NULL;
-    map->auxpict = NULL;*/
-    
-    /* Now we do everything else involved in loading the Blorb file,
-        such as building resource lists. */
-    
-    err = giblorb_initialize_map(map);
-    if (err) {
-        giblorb_destroy_map(map);
-        return err;
+    *newchunks = chunks;
+    *newnumchunks = numchunks;
+    return giblorb_err_None;
+}
+
+/* Read "len" bytes at "pos", and return the number of bytes read. */
+static glui32 giblorb_read(strid_t file, unsigned char *mapped, 
+    glui32 mappedlen, glui32 pos, char *buffer, glui32 len)
+{
+    if (mapped) {
+        if (pos >= mappedlen)
+            return 0;
+        if (len > mappedlen - pos)
+            len = mappedlen - pos;
+        memcpy(buffer, mapped + pos, len);
+        return len;
     }
     
-    *newmap = map;
-    return giblorb_err_None;
+    glk_stream_set_position(file, pos, seekmode_Start);
+    return glk_get_buffer_stream(file, buffer, len);
 }
 
 static giblorb_err_t giblorb_initialize_map(giblorb_map_t *map)
@@ -342,6 +420,11 @@ giblorb_err_t giblorb_destroy_map(giblorb_map_t *map)
     
     map->numresources = 0;
     
+    if (map->mapped) {
+        giblorb_unmap_stream(map->file, map->mapped, map->mappedlen);
+        map->mapped = NULL;
+    }
+    
     map->file = NULL;
     map->inited = 0;
     
@@ -378,7 +461,7 @@ giblorb_err_t giblorb_load_chunk_by_number(giblorb_map_t *map,
 {
     giblorb_chunkdesc_t *chu;
     
-    if (chunknum < 0 || chunknum >= map->numchunks)
+    if (chunknum >= map->numchunks)
         return giblorb_err_NotFound;
 
     chu = &(map->chunks[chunknum]);
@@ -394,9 +477,17 @@ giblorb_err_t giblorb_load_chunk_by_number(giblorb_map_t *map,
             break;
             
         case giblorb_method_Memory:
+            if (map->mapped) {
+                /* Checked in giblorb_index_chunks(). */
+                res->data.ptr = map->mapped + chu->datpos;
+                break;
+            }
             if (!chu->ptr) {
                 glui32 readlen;
-                void *dat = giblorb_malloc(chu->len);
+                void *dat;
+                
+                giblorb_make_room(map, chu->len);
+                dat = giblorb_malloc(chu->len);
                 
                 if (!dat)
                     return giblorb_err_Alloc;
@@ -406,11 +497,15 @@ giblorb_err_t giblorb_load_chunk_by_number(giblorb_map_t *map,
                 
                 readlen = glk_get_buffer_stream(map->file, dat, 
                     chu->len);
-                if (readlen != chu->len)
+                if (readlen != chu->len) {
+                    giblorb_free(dat);
                     return giblorb_err_Read;
+                }
                 
                 chu->ptr = dat;
+                map->memused += chu->len;
             }
+            chu->lastuse = ++map->usecounter;
             res->data.ptr = chu->ptr;
             break;
     }
@@ -443,19 +538,68 @@ giblorb_err_t giblorb_unload_chunk(giblorb_map_t *map, glui32 chunknum)
 {
     giblorb_chunkdesc_t *chu;
     
-    if (chunknum < 0 || chunknum >= map->numchunks)
+    if (chunknum >= map->numchunks)
         return giblorb_err_NotFound;
 
     chu = &(map->chunks[chunknum]);
     
-    if (chu->ptr) {
+    if (chu->ptr && chu->refcount == 0) {
         giblorb_free(chu->ptr);
         chu->ptr = NULL;
+        map->memused -= chu->len;
     }
     
     return giblorb_err_None;
 }
 
+giblorb_err_t giblorb_set_memory_limit(giblorb_map_t *map, glui32 bytes)
+{
+    map->memlimit = bytes;
+    return giblorb_err_None;
+}
+
+giblorb_err_t giblorb_retain_chunk(giblorb_map_t *map, glui32 chunknum)
+{
+    if (chunknum >= map->numchunks)
+        return giblorb_err_NotFound;
+    
+    map->chunks[chunknum].refcount++;
+    return giblorb_err_None;
+}
+
+giblorb_err_t giblorb_release_chunk(giblorb_map_t *map, glui32 chunknum)
+{
+    if (chunknum >= map->numchunks)
+        return giblorb_err_NotFound;
+    
+    if (map->chunks[chunknum].refcount > 0)
+        map->chunks[chunknum].refcount--;
+    return giblorb_err_None;
+}
+
+/* Unload the least recently loaded chunks (which are not retained), 
+    until a chunk of "len" bytes fits into the memory limit, or 
+    nothing is left to unload. */
+static void giblorb_make_room(giblorb_map_t *map, glui32 len)
+{
+    while (map->memlimit && map->memused + len > map->memlimit) {
+        int ix, oldest = -1;
+        
+        for (ix=0; ix<map->numchunks; ix++) {
+            giblorb_chunkdesc_t *chu = &(map->chunks[ix]);
+            if (chu->ptr && chu->refcount == 0 
+                && (oldest < 0 
+                    || chu->lastuse < map->chunks[oldest].lastuse))
+                oldest = ix;
+        }
+        
+        if (oldest < 0)
+            break;
+        
+        giblorb_unload_chunk(map, oldest);
+    }
+}
+
 giblorb_err_t giblorb_count_resources(giblorb_map_t *map, glui32 usage,
     glui32 *num, glui32 *min, glui32 *max)
 {
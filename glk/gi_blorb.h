@@ -72,6 +72,22 @@ extern giblorb_err_t giblorb_load_chunk_by_number(giblorb_map_t *map,
 extern giblorb_err_t giblorb_unload_chunk(giblorb_map_t *map, 
     glui32 chunknum);
 
+/* Chunks loaded with giblorb_method_Memory may be unloaded 
+    automatically by the next load, when they use more memory than set 
+    by giblorb_set_memory_limit() (0, the default, means no limit). The 
+    least recently loaded chunks are unloaded first. To keep the data of 
+    a chunk longer, call giblorb_retain_chunk(); giblorb_release_chunk() 
+    undoes this. 
+    So, once a limit is set, the pointer returned for a chunk which is 
+    not retained is only valid until the next load; a limit must not be 
+    set when other code (like an interpreter) keeps such pointers. */
+extern giblorb_err_t giblorb_set_memory_limit(giblorb_map_t *map, 
+    glui32 bytes);
+extern giblorb_err_t giblorb_retain_chunk(giblorb_map_t *map, 
+    glui32 chunknum);
+extern giblorb_err_t giblorb_release_chunk(giblorb_map_t *map, 
+    glui32 chunknum);
+
 extern giblorb_err_t giblorb_load_resource(giblorb_map_t *map, 
     glui32 method, giblorb_result_t *res, glui32 usage, 
     glui32 resnum);
@@ -85,4 +101,13 @@ extern giblorb_err_t giblorb_count_resources(giblorb_map_t *map,
 extern giblorb_err_t giblorb_set_resource_map(strid_t file);
 extern giblorb_map_t *giblorb_get_resource_map(void);
 
+/* Map the whole file behind a stream into memory, and return it, with 
+    its length in *len; or return NULL if this is not possible, in which 
+    case the stream is read as usual. The memory may be written to, but 
+    changes never reach the file. The mapping is released by 
+    giblorb_unmap_stream(), which is passed the same stream; it must 
+    still be open. */
+extern void *giblorb_map_stream(strid_t file, glui32 *len);
+extern void giblorb_unmap_stream(strid_t file, void *ptr, glui32 len);
+
 #endif /* _GI_BLORB_H */
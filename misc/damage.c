@@ -0,0 +1,130 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Tracking of damaged (changed) regions of the screen. Anything which
+ * draws on the screen surface reports the region by nano_damage();
+ * nano_update() then copies only these regions to the screen, instead
+ * of the whole frame buffer (as SDL_Flip() does for software
+ * surfaces).
+ *
+ * Overlapping rectangles are merged, so that no pixel is updated
+ * twice. When there are too many rectangles, the bounding box is used.
+ */
+
+#include "misc.h"
+
+#define MAX_RECTS 32
+
+struct rect
+{
+   int x1, y1, x2, y2; // x2 and y2 are exclusive
+};
+
+static struct rect rects[MAX_RECTS];
+static int num_rects = 0;
+static int all_damaged = FALSE;
+
+static int overlap(struct rect *r1, struct rect *r2)
+{
+   return r1->x1 < r2->x2 && r2->x1 < r1->x2 &&
+      r1->y1 < r2->y2 && r2->y1 < r1->y2;
+}
+
+static void merge(struct rect *r1, struct rect *r2)
+{
+   r1->x1 = MIN(r1->x1, r2->x1);
+   r1->y1 = MIN(r1->y1, r2->y1);
+   r1->x2 = MAX(r1->x2, r2->x2);
+   r1->y2 = MAX(r1->y2, r2->y2);
+}
+
+/*
+ * Report a region of the screen, which has been changed.
+ */
+void nano_damage(int x, int y, int w, int h)
+{
+   if(all_damaged || w <= 0 || h <= 0)
+      return;
+
+   struct rect r = { x, y, x + w, y + h };
+
+   // Merge with all overlapping rectangles. Since the result may overlap
+   // with rectangles tested before, start again after each merge.
+   for(int i = 0; i < num_rects; ) {
+      if(overlap(&r, &rects[i])) {
+         merge(&r, &rects[i]);
+         rects[i] = rects[--num_rects];
+         i = 0;
+      } else
+         i++;
+   }
+
+   if(num_rects == MAX_RECTS) {
+      // Too many: use the bounding box.
+      for(int i = 0; i < num_rects; i++)
+         merge(&r, &rects[i]);
+      num_rects = 0;
+   }
+
+   rects[num_rects++] = r;
+}
+
+/*
+ * Report that the whole screen has been changed.
+ */
+void nano_damage_all(void)
+{
+   all_damaged = TRUE;
+   num_rects = 0;
+}
+
+/*
+ * Copy all damaged regions to the screen; replaces SDL_Flip(). For
+ * double-buffered hardware surfaces, the buffers are always flipped.
+ */
+void nano_update(SDL_Surface *surface)
+{
+   if((surface->flags & (SDL_HWSURFACE | SDL_DOUBLEBUF))
+      == (SDL_HWSURFACE | SDL_DOUBLEBUF))
+      SDL_Flip(surface);
+   else if(all_damaged)
+      SDL_UpdateRect(surface, 0, 0, 0, 0);
+   else if(num_rects > 0) {
+      // SDL_UpdateRects() expects rectangles within the surface.
+      SDL_Rect sr[MAX_RECTS];
+      int n = 0;
+      for(int i = 0; i < num_rects; i++) {
+         int x1 = MAX(rects[i].x1, 0), y1 = MAX(rects[i].y1, 0);
+         int x2 = MIN(rects[i].x2, surface->w), y2 = MIN(rects[i].y2, surface->h);
+         if(x1 < x2 && y1 < y2) {
+            sr[n].x = x1;
+            sr[n].y = y1;
+            sr[n].w = x2 - x1;
+            sr[n].h = y2 - y1;
+            n++;
+         }
+      }
+
+      SDL_UpdateRects(surface, n, sr);
+   }
+
+   num_rects = 0;
+   all_damaged = FALSE;
+}
@@ -208,9 +208,10 @@ struct input_file
    int sel_file;  /* index of the selected file, starting with 0, or -1, when
                      no file is selected */
 
-   // buffer and state for the input; see "nano_input_text16"
+   // buffer, state and metrics for the input; see "nano_input_text16"
    Uint16 input_buf[FILENAME_MAX + 1];
    int input_state;
+   struct nano_metrics *input_metrics;
 
    // currently selected directory
    char curpath[FILENAME_MAX + 1];
@@ -310,6 +311,7 @@ static void read_dir(struct input_file *infi)
    SDL_Rect r1 = { 0, 0, t->w, t->h };
    SDL_Rect r2 = { infi->xd + 1, infi->yd + 1, t->w, t->h };
    SDL_BlitSurface(t, &r1, infi->surface, &r2);
+   nano_damage(r2.x, r2.y, r2.w, r2.h); // may be larger than the inset
    SDL_FreeSurface(t);
    free(curpath16);
    
@@ -709,6 +711,7 @@ char *nano_input_file(char *path, Uint16 *title, SDL_Surface *surface,
    
    infi.input_buf[0] = 0;
    infi.input_state = -1;
+   infi.input_metrics = nano_metrics_new(font);
    
    char *result;
    int main_loop = 1;
@@ -722,7 +725,7 @@ char *nano_input_file(char *path, Uint16 *title, SDL_Surface *surface,
       nano_input_text16(surface, &event, infi.input_buf,
                         FILENAME_MAX, 255,
                         infi.xi + 1, infi.yi + 1, infi.wi - 2, infi.hi - 2,
-                        font, ifg, ibg, &infi.input_state);
+                        infi.input_metrics, ifg, ibg, &infi.input_state);
       if(event.type == SDL_KEYDOWN) {
          switch(event.key.keysym.sym) {
          case SDLK_RETURN:
@@ -781,6 +784,7 @@ char *nano_input_file(char *path, Uint16 *title, SDL_Surface *surface,
       free(infi.filtered_files);
    if(infi.all_files)
       free_files(infi.all_files, infi.num_all_files);
+   nano_metrics_free(infi.input_metrics);
 
    nano_restore_window(surface);
    return result;
@@ -0,0 +1,319 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A cache for rendered glyphs. Rasterizing text with FreeType is
+ * rather expensive, but the number of different characters, fonts and
+ * colors actually used is small. So each glyph is rendered only once
+ * (for a given font, foreground and background), and text is then put
+ * together from the cached glyph surfaces.
+ *
+ * A glyph surface is the result of rendering the single character with
+ * TTF_RenderUNICODE_Shaded(), so that it is positioned vertically in
+ * the same way as a whole string would be. The background (palette
+ * index 0 for "shaded" surfaces) is made transparent, so that glyphs
+ * overhanging their advance (e. g. italics) are not cut off by the
+ * following glyph.
+ *
+ * Furthermore, this file contains the metrics tables (struct
+ * nano_metrics), which are used both for measuring text (so that line
+ * breaking needs no rasterizing at all) and for positioning the glyphs
+ * when text is rendered; so both are always consistent.
+ */
+
+#include "misc.h"
+
+#define NUM_BUCKETS 1024  // must be a power of 2
+#define MAX_GLYPHS  4096  // when reached, the whole cache is flushed
+
+// Kerning is only accessible with newer versions of SDL_ttf. (2.0.12 and
+// 2.0.13 expect glyph indices, which TTF_GlyphIsProvided() returns.)
+#if SDL_TTF_MAJOR_VERSION > 2 || SDL_TTF_MINOR_VERSION > 0 || \
+   SDL_TTF_PATCHLEVEL >= 14
+#  define HAVE_KERNING
+#  define GET_KERNING(font, c1, c2) TTF_GetFontKerningSizeGlyphs(font, c1, c2)
+#elif SDL_TTF_PATCHLEVEL >= 12
+#  define HAVE_KERNING
+#  define GET_KERNING(font, c1, c2) \
+   TTF_GetFontKerningSize(font, TTF_GlyphIsProvided(font, c1), \
+                          TTF_GlyphIsProvided(font, c2))
+#endif
+
+struct glyph
+{
+   struct glyph *next;    // next in the bucket
+   TTF_Font *font;
+   Uint32 fg, bg;         // colors, as 0xRRGGBB
+   Uint16 ch;
+   SDL_Surface *surface;  // NULL for characters not rendered (e. g. 0)
+   int offset;            /* x position of the surface, relative to the
+                             pen position (not 0 for a negative minx) */
+};
+
+static struct glyph *buckets[NUM_BUCKETS];
+static int num_glyphs = 0;
+static long num_hits = 0, num_misses = 0;
+
+static Uint32 color_key(SDL_Color c)
+{
+   return (c.r << 16) | (c.g << 8) | c.b;
+}
+
+static unsigned int hash(TTF_Font *font, Uint32 fg, Uint32 bg, Uint16 ch)
+{
+   unsigned int h = ch;
+   h = h * 31 + ((unsigned long)font >> 4);
+   h = h * 31 + fg;
+   h = h * 31 + bg;
+   return (h ^ (h >> 10)) & (NUM_BUCKETS - 1);
+}
+
+/*
+ * Free all cached glyphs. Called automatically when the cache becomes
+ * too large; must be called before a font is closed.
+ */
+void nano_glyph_flush(void)
+{
+   for(int i = 0; i < NUM_BUCKETS; i++) {
+      for(struct glyph *g = buckets[i]; g; ) {
+         struct glyph *n = g->next;
+         if(g->surface)
+            SDL_FreeSurface(g->surface);
+         free(g);
+         g = n;
+      }
+      buckets[i] = NULL;
+   }
+
+   num_glyphs = 0;
+}
+
+/*
+ * Return the cached glyph, render it if not yet in the cache.
+ */
+static struct glyph *get_glyph(TTF_Font *font, Uint16 ch,
+                               SDL_Color fg, SDL_Color bg)
+{
+   Uint32 kfg = color_key(fg), kbg = color_key(bg);
+   unsigned int h = hash(font, kfg, kbg, ch);
+
+   for(struct glyph *g = buckets[h]; g; g = g->next)
+      if(g->ch == ch && g->font == font && g->fg == kfg && g->bg == kbg) {
+         num_hits++;
+         return g;
+      }
+
+   num_misses++;
+
+   struct glyph *g = (struct glyph*)nano_malloc(sizeof(struct glyph));
+   g->font = font;
+   g->fg = kfg;
+   g->bg = kbg;
+   g->ch = ch;
+
+   int minx, maxx, miny, maxy, advance;
+   if(ch == 0 || TTF_GlyphMetrics(font, ch, &minx, &maxx, &miny, &maxy,
+                                  &advance) != 0) {
+      g->offset = 0;
+      g->surface = NULL;
+   } else {
+      Uint16 str[2] = { ch, 0 };
+      g->offset = MIN(minx, 0);
+      g->surface = TTF_RenderUNICODE_Shaded(font, str, fg, bg);
+      if(g->surface)
+         SDL_SetColorKey(g->surface, SDL_SRCCOLORKEY, 0);
+   }
+
+   g->next = buckets[h];
+   buckets[h] = g;
+   num_glyphs++;
+
+   return g;
+}
+
+/*
+ * Create the metrics table for a font. The advances of all Latin-1
+ * characters are determined at once; kerning is determined lazily,
+ * for each first character of a pair on demand.
+ */
+struct nano_metrics *nano_metrics_new(TTF_Font *font)
+{
+   struct nano_metrics *m =
+      (struct nano_metrics*)nano_malloc(sizeof(struct nano_metrics));
+   m->font = font;
+   m->height = TTF_FontHeight(font);
+
+   for(int c = 0; c < 256; c++) {
+      int minx, maxx, miny, maxy, advance;
+      if(c == 0 || TTF_GlyphMetrics(font, c, &minx, &maxx, &miny, &maxy,
+                                    &advance) != 0)
+         advance = 0;
+      m->advance[c] = advance;
+      m->kerning[c] = NULL;
+   }
+
+#ifdef HAVE_KERNING
+   m->use_kerning = TTF_GetFontKerning(font);
+#else
+   m->use_kerning = FALSE;
+#endif
+
+   return m;
+}
+
+/*
+ * Free a metrics table. Does not close the font.
+ */
+void nano_metrics_free(struct nano_metrics *m)
+{
+   for(int c = 0; c < 256; c++)
+      if(m->kerning[c])
+         free(m->kerning[c]);
+   free(m);
+}
+
+static int get_advance(struct nano_metrics *m, Uint16 ch)
+{
+   if(ch < 256)
+      return m->advance[ch];
+   else {
+      int minx, maxx, miny, maxy, advance;
+      if(TTF_GlyphMetrics(m->font, ch, &minx, &maxx, &miny, &maxy,
+                          &advance) != 0)
+         advance = 0;
+      return advance;
+   }
+}
+
+/*
+ * Kerning between two characters; only regarded for Latin-1.
+ */
+static int get_kerning(struct nano_metrics *m, Uint16 c1, Uint16 c2)
+{
+#ifdef HAVE_KERNING
+   if(!m->use_kerning || c1 == 0 || c2 == 0 || c1 >= 256 || c2 >= 256)
+      return 0;
+
+   if(m->kerning[c1] == NULL) {
+      m->kerning[c1] = (Sint8*)nano_malloc(256 * sizeof(Sint8));
+      m->kerning[c1][0] = 0;
+      for(int c = 1; c < 256; c++)
+         m->kerning[c1][c] = GET_KERNING(m->font, c1, c);
+   }
+
+   return m->kerning[c1][c2];
+#else
+   return 0;
+#endif
+}
+
+/*
+ * Return the width of the first "len" characters of "text" (not
+ * neccessarily 0-terminated), as rendered by nano_render16(), without
+ * rendering anything.
+ */
+int nano_width16(struct nano_metrics *m, const Uint16 *text, int len)
+{
+   int w = 0;
+   for(int i = 0; i < len; i++) {
+      if(i > 0)
+         w += get_kerning(m, text[i - 1], text[i]);
+      w += get_advance(m, text[i]);
+   }
+   return w;
+}
+
+/*
+ * Return the kerning between two characters, in the way regarded by
+ * nano_width16() and nano_render16(). Together with the width of single
+ * characters, this allows to measure text incrementally.
+ */
+int nano_kerning16(struct nano_metrics *m, Uint16 c1, Uint16 c2)
+{
+   return get_kerning(m, c1, c2);
+}
+
+/*
+ * Render the first "len" characters of "text", like
+ * TTF_RenderUNICODE_Shaded() does, but put together from cached
+ * glyphs. "text" does not have to be 0-terminated. The surface is
+ * nano_width16() pixels wide (or 1, if this is 0); glyphs overhanging
+ * at the left or right are cut off. The caller has to free the
+ * returned surface.
+ */
+SDL_Surface *nano_render16(struct nano_metrics *m, const Uint16 *text,
+                           int len, SDL_Color fg, SDL_Color bg)
+{
+   // Flushed in advance, never while glyphs for this text are collected
+   // (this may let the cache grow beyond MAX_GLYPHS for a very long text,
+   // until the next call).
+   if(num_glyphs > 0 && num_glyphs + len > MAX_GLYPHS) {
+      nano_info("glyph cache full (%d glyphs), flushed", num_glyphs);
+      nano_glyph_flush();
+   }
+
+   struct glyph *glyphs[len > 0 ? len : 1];
+   for(int i = 0; i < len; i++)
+      glyphs[i] = get_glyph(m->font, text[i], fg, bg);
+
+   SDL_Surface *s =
+      SDL_CreateRGBSurface(SDL_SWSURFACE,
+                           MAX(nano_width16(m, text, len), 1), m->height,
+                           8, 0, 0, 0, 0);
+   if(s == NULL)
+      nano_fail("Cannot create surface: %s", SDL_GetError());
+
+   // Same palette as used by TTF_RenderUNICODE_Shaded() (identical for all
+   // glyphs, since they share the colors), so that the glyphs are simply
+   // copied.
+   SDL_Palette *p = NULL;
+   for(int i = 0; p == NULL && i < len; i++)
+      if(glyphs[i]->surface)
+         p = glyphs[i]->surface->format->palette;
+
+   if(p) {
+      SDL_SetColors(s, p->colors, 0, p->ncolors);
+      SDL_FillRect(s, NULL, 0);
+   } else
+      SDL_FillRect(s, NULL, SDL_MapRGB(s->format, bg.r, bg.g, bg.b));
+
+   int x = 0;
+   for(int i = 0; i < len; i++) {
+      if(i > 0)
+         x += get_kerning(m, text[i - 1], text[i]);
+      if(glyphs[i]->surface) {
+         SDL_Rect r = { x + glyphs[i]->offset, 0,
+                        glyphs[i]->surface->w, glyphs[i]->surface->h };
+         SDL_BlitSurface(glyphs[i]->surface, NULL, s, &r);
+      }
+      x += get_advance(m, text[i]);
+   }
+
+   return s;
+}
+
+/*
+ * Return the number of cache hits and misses since the program has been
+ * started. Useful to check whether the cache works as expected.
+ */
+void nano_glyph_stats(long *hits, long *misses)
+{
+   *hits = num_hits;
+   *misses = num_misses;
+}
@@ -0,0 +1,212 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * An input history: a ring buffer of lines, so that adding a line is
+ * cheap, also when the history is full (then, the oldest line is
+ * dropped).
+ *
+ * For searching, a 64 bit signature is kept for each line: for each
+ * character and each pair of characters, one bit (selected by a hash
+ * value) is set. A line can only contain a pattern, when it contains
+ * all bits of the signature of the pattern; so most lines are skipped
+ * by testing one word.
+ *
+ * Optionally, the history is preserved in a file (one line in UTF-8
+ * per entry). Lines are appended when added; when the file has become
+ * too long, it is written again when read.
+ */
+
+#include "misc.h"
+
+struct nano_history
+{
+   Uint16 **lines;        // ring buffer, starting at "first"
+   Uint64 *signatures;    // the signatures of the lines, same order
+   int first, num, max;
+   char *filename;        // NULL, when the history is not preserved
+};
+
+static Uint64 signature(const Uint16 *text);
+static int contains(const Uint16 *text, const Uint16 *pattern);
+static void add(struct nano_history *h, const Uint16 *text);
+static void write_line(FILE *file, const Uint16 *text);
+
+/*
+ * Create a new history with "max" lines. If "filename" is not NULL, the
+ * history is read from this file, and new lines are appended to it.
+ */
+struct nano_history *nano_history_new(int max, const char *filename)
+{
+   struct nano_history *h =
+      (struct nano_history*)nano_malloc(sizeof(struct nano_history));
+   h->max = MAX(max, 1);
+   h->lines = (Uint16**)nano_malloc(h->max * sizeof(Uint16*));
+   h->signatures = (Uint64*)nano_malloc(h->max * sizeof(Uint64));
+   h->first = h->num = 0;
+   h->filename = filename ? strdup(filename) : NULL;
+
+   if(h->filename) {
+      FILE *file = fopen(h->filename, "r");
+      if(file) {
+         int num_read = 0;
+         char buf[4096];
+         while(fgets(buf, sizeof(buf), file)) {
+            char *nl = strchr(buf, '\n');
+            if(nl)
+               *nl = 0;
+            Uint16 *text = nano_strdup16fromutf8(buf);
+            if(text) {
+               if(text[0])
+                  add(h, text);
+               free(text);
+            }
+            num_read++;
+         }
+         fclose(file);
+
+         if(num_read > h->max) {
+            // Remove the lines not used anymore.
+            nano_info("history file '%s': %d lines, rewritten with %d",
+                      h->filename, num_read, h->num);
+            if((file = fopen(h->filename, "w"))) {
+               for(int i = 0; i < h->num; i++)
+                  write_line(file, nano_history_get(h, i));
+               fclose(file);
+            }
+         }
+      }
+   }
+
+   return h;
+}
+
+void nano_history_free(struct nano_history *h)
+{
+   for(int i = 0; i < h->num; i++)
+      free(h->lines[(h->first + i) % h->max]);
+   free(h->lines);
+   free(h->signatures);
+   if(h->filename)
+      free(h->filename);
+   free(h);
+}
+
+/*
+ * Return the number of lines.
+ */
+int nano_history_num(struct nano_history *h)
+{
+   return h->num;
+}
+
+/*
+ * Return a line; 0 is the oldest one, nano_history_num() - 1 the newest.
+ */
+const Uint16 *nano_history_get(struct nano_history *h, int i)
+{
+   return h->lines[(h->first + i) % h->max];
+}
+
+/*
+ * Add a line at the end, but only when it is not empty, and different
+ * from the last one. The numbers of the lines change when the history
+ * is full.
+ */
+void nano_history_add(struct nano_history *h, const Uint16 *text)
+{
+   if(text[0] == 0 ||
+      (h->num > 0 && strcmp16(text, nano_history_get(h, h->num - 1)) == 0))
+      return;
+
+   add(h, text);
+
+   if(h->filename) {
+      FILE *file = fopen(h->filename, "a");
+      if(file) {
+         write_line(file, text);
+         fclose(file);
+      } else
+         nano_warn("cannot append to history file '%s'", h->filename);
+   }
+}
+
+/*
+ * Search backwards for a line containing "pattern", starting at line
+ * "start". Return the number of the line, or -1, if there is none.
+ */
+int nano_history_search(struct nano_history *h, const Uint16 *pattern,
+                        int start)
+{
+   Uint64 sig = signature(pattern);
+   for(int i = MIN(start, h->num - 1); i >= 0; i--) {
+      int j = (h->first + i) % h->max;
+      if((h->signatures[j] & sig) == sig && contains(h->lines[j], pattern))
+         return i;
+   }
+   return -1;
+}
+
+Uint64 signature(const Uint16 *text)
+{
+   Uint64 sig = 0;
+   for(int i = 0; text[i]; i++) {
+      sig |= (Uint64)1 << (text[i] % 64);
+      if(i > 0)
+         sig |= (Uint64)1 << ((text[i - 1] * 31 + text[i]) % 64);
+   }
+   return sig;
+}
+
+int contains(const Uint16 *text, const Uint16 *pattern)
+{
+   for(int i = 0; text[i]; i++) {
+      int j = 0;
+      while(pattern[j] && text[i + j] == pattern[j])
+         j++;
+      if(pattern[j] == 0)
+         return TRUE;
+   }
+
+   return pattern[0] == 0;
+}
+
+void add(struct nano_history *h, const Uint16 *text)
+{
+   int j;
+   if(h->num == h->max) {
+      // Full: replace the oldest line.
+      j = h->first;
+      free(h->lines[j]);
+      h->first = (h->first + 1) % h->max;
+   } else {
+      j = (h->first + h->num) % h->max;
+      h->num++;
+   }
+
+   h->lines[j] = strdup16(text);
+   h->signatures[j] = signature(text);
+}
+
+void write_line(FILE *file, const Uint16 *text)
+{
+   char *s = strduputf8from16(text);
+   fprintf(file, "%s\n", s);
+   free(s);
+}
@@ -44,10 +44,12 @@ struct saved_window
 } *saved_window = NULL;
 
 static void (*registered_key_func[26])(void);
+static void (*fail_func)(void) = NULL;
 
 static int _allow_suspend = FALSE;
 
 static void quit(void);
+static void call_fail_func(void);
 
 /*
  * Some initialization. The arguments of main() should be passed.
@@ -180,6 +182,7 @@ void nano_fail(const char *fmt, ...)
    va_end (argp2);
    
    fprintf(stderr, "\n");
+   call_fail_func();
    abort();
 }
 
@@ -223,10 +226,30 @@ void nano_failunless (int b, const char *fmt, ...)
       va_end (argp2);
    
       fprintf(stderr, "\n");
+      call_fail_func();
       abort();
    }
 }
 
+/*
+ * Register a function, which is called by nano_fail() and
+ * nano_failunless() before the program is aborted; e. g. to save
+ * data which would otherwise be lost.
+ */
+void nano_set_fail_func(void (*func)(void))
+{
+   fail_func = func;
+}
+
+void call_fail_func(void)
+{
+   // Only once, in case it fails itself.
+   void (*func)(void) = fail_func;
+   fail_func = NULL;
+   if(func)
+      func();
+}
+
 /*
  * Simple wrapper for malloc().
  */
@@ -336,7 +359,8 @@ static void handle_cont()
              saved->buf, saved->w * saved->h * saved->bpp);
       SDL_UnlockSurface(*saved->surface);
       free(saved->buf);
-      SDL_Flip(*saved->surface);
+      nano_damage_all();
+      nano_update(*saved->surface);
    }
 }
 
@@ -467,6 +491,8 @@ void nano_restore_window(SDL_Surface *surface)
    if(saved_window) {
       SDL_Rect r = { 0,  0, saved_window->r.w, saved_window->r.h };
       SDL_BlitSurface(saved_window->saved, &r, surface, &saved_window->r);
+      nano_damage(saved_window->r.x, saved_window->r.y,
+                  saved_window->r.w, saved_window->r.h);
       SDL_FreeSurface(saved_window->saved);
 
       struct saved_window *sw = saved_window;
@@ -74,6 +74,7 @@ void nano_warnunless(int b, const char *fmt, ...)
    __attribute__((format(printf, 2, 3)));
 void nano_failunless(int b, const char *fmt, ...)
    __attribute__((format(printf, 2, 3)));
+void nano_set_fail_func(void (*func)(void));
 
 void *nano_malloc(size_t size);
 
@@ -84,9 +85,15 @@ Uint16 *nano_strdup16(const Uint16 *src);
 int nano_strcmp16(const Uint16 *s1, const Uint16 *s2);
 Uint16 *nano_strchr16(const Uint16 *s, Uint16 c);
 Uint16 *nano_strrchr16(const Uint16 *s, Uint16 c);
+Uint32 *nano_memchr32(const Uint32 *s, Uint32 c, size_t n);
 
 Uint16 *nano_strdup16fromutf8(const char *src);
 char *nano_strduputf8from16(const Uint16 *src);
+int nano_utf8_encode(const Uint32 *src, int len, char *dest);
+int nano_utf8_decode(const char *src, int len, Uint32 *dest, int max,
+                     int *used);
+void nano_ucs4be_encode(const Uint32 *src, int len, char *dest);
+void nano_ucs4be_decode(const char *src, int len, Uint32 *dest);
 
 void nano_expand_env(const char *src, char *dest, int maxlen);
 
@@ -103,6 +110,30 @@ void nano_conf_free(conf_t conf);
 void nano_conf_put(conf_t conf, const char **pattern, const char *value);
 const char *nano_conf_get(conf_t conf, const char **path, const char *def);
 
+struct nano_history;
+
+struct nano_history *nano_history_new(int max, const char *filename);
+void nano_history_free(struct nano_history *h);
+int nano_history_num(struct nano_history *h);
+const Uint16 *nano_history_get(struct nano_history *h, int i);
+void nano_history_add(struct nano_history *h, const Uint16 *text);
+int nano_history_search(struct nano_history *h, const Uint16 *pattern,
+                        int start);
+
+struct nano_job;
+
+void nano_workers_init(int num);
+void nano_workers_quit(void);
+int nano_workers_num(void);
+struct nano_job *nano_job_start(void (*func)(void *data), void *data);
+void nano_job_wait(struct nano_job *job);
+void nano_run_parallel(void (*func)(void *data, int part, int num_parts),
+                       void *data, int num_parts);
+
+void nano_damage(int x, int y, int w, int h);
+void nano_damage_all(void);
+void nano_update(SDL_Surface *surface);
+
 void nano_register_key(char key, void (*func)(void));
 void nano_wait_event(SDL_Event *event);
 void nano_reg_surface(SDL_Surface **surface);
@@ -130,13 +161,36 @@ void nano_fill_3d_inset(SDL_Surface *surface, SDL_Color bg,
 void nano_fill_3d_outset(SDL_Surface *surface, SDL_Color bg,
                          int x, int y, int w, int h);
 
+/*
+ * Metrics of a font, so that text can be measured without rendering;
+ * see "glyph.c".
+ */
+struct nano_metrics
+{
+   TTF_Font *font;
+   int height;            // TTF_FontHeight()
+   Sint16 advance[256];   // advances of the Latin-1 characters
+   Sint8 *kerning[256];   /* kerning[c1][c2] is the kerning between c1 and
+                             c2; rows are created on demand */
+   int use_kerning;
+};
+
+struct nano_metrics *nano_metrics_new(TTF_Font *font);
+void nano_metrics_free(struct nano_metrics *m);
+int nano_width16(struct nano_metrics *m, const Uint16 *text, int len);
+int nano_kerning16(struct nano_metrics *m, Uint16 c1, Uint16 c2);
+void nano_glyph_flush(void);
+SDL_Surface *nano_render16(struct nano_metrics *m, const Uint16 *text,
+                           int len, SDL_Color fg, SDL_Color bg);
+void nano_glyph_stats(long *hits, long *misses);
+
 void nano_show_message(SDL_Surface *surface, Uint16 **msg,
                        SDL_Color dfg, SDL_Color dbg, TTF_Font *font);
 int nano_ask_yes_no(SDL_Surface *surface, Uint16 **msg, int default_answer,
                     SDL_Color dfg, SDL_Color dbg, TTF_Font *font);
 void nano_input_text16(SDL_Surface *surface, SDL_Event *event,
                        Uint16 *text, int max_len, int max_char,
-                       int x, int y, int w, int h, TTF_Font *font,
+                       int x, int y, int w, int h, struct nano_metrics *m,
                        SDL_Color fg, SDL_Color bg, int *state);
 char *nano_input_file(char *path, Uint16 *title, SDL_Surface *surface,
                       TTF_Font *font, int line_height,
@@ -0,0 +1,361 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Scaling of surfaces.
+ *
+ * The filter is separable: for each axis, every destination pixel is
+ * a weighted sum of a few source pixels ("taps"). When scaling down, a
+ * box filter is used (each source pixel contributes with the part it
+ * covers of the destination pixel); when scaling up, a bilinear
+ * filter. Weights are fixed point numbers with WEIGHT_BITS bits, which
+ * sum up to 1.
+ *
+ * The surface is processed row by row: for each destination row, the
+ * source rows are first combined into one row (vertical pass), which
+ * is then scaled horizontally into the destination. The vertical pass
+ * works on plain bytes and uses SSE2 or NEON, when available; the
+ * horizontal pass is specialized for 24 and 32 bits per pixel. Other
+ * formats (with less than one byte per color channel) are converted to
+ * 32 bits per pixel before, and back afterwards.
+ *
+ * Large surfaces are divided into horizontal bands, which are scaled in
+ * parallel by the worker threads (see "workers.c").
+ */
+
+#include "misc.h"
+
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+#define WEIGHT_BITS 14
+#define WEIGHT_ONE (1 << WEIGHT_BITS)
+
+// Surfaces smaller than this (number of pixels, source and destination
+// together) are not divided into bands; neither are bands smaller than
+// MIN_BAND_ROWS.
+#define MIN_PARALLEL_PIXELS 65536
+#define MIN_BAND_ROWS 16
+
+/*
+ * The taps for one axis: destination pixel j is the sum of the source
+ * pixels start[j] to start[j] + count[j] - 1, multiplied with
+ * weights[j * max_taps] and following.
+ */
+struct axis
+{
+   int *start, *count;
+   Sint16 *weights;
+   int max_taps;
+};
+
+struct scaling
+{
+   SDL_Surface *src, *dst;
+   struct axis hor, ver;
+};
+
+static void init_axis(struct axis *ax, int n, int m);
+static void free_axis(struct axis *ax);
+static void scale_pixels(SDL_Surface *src, SDL_Surface *dst);
+static void scale_band(void *data, int part, int num_parts);
+static void combine_rows(const Uint8 **rows, const Sint16 *weights,
+                         int count, Uint8 *dest, int len);
+static inline void scale_row(const Uint8 *src, Uint8 *dest,
+                             const struct axis *ax, int m, int bpp);
+
+/*
+ * Scale a surface; the result has the same format.
+ */
+SDL_Surface *nano_scale_surface(SDL_Surface *surface,
+                                Uint16 width, Uint16 height)
+{
+   SDL_PixelFormat *fmt = surface->format;
+   SDL_Surface *scaled =
+      SDL_CreateRGBSurface(surface->flags, width, height, fmt->BitsPerPixel,
+                           fmt->Rmask, fmt->Gmask, fmt->Bmask, fmt->Amask);
+   if(scaled == NULL)
+      return NULL;
+
+   if(fmt->palette)
+      SDL_SetColors(scaled, fmt->palette->colors, 0, fmt->palette->ncolors);
+   if(surface->flags & SDL_SRCCOLORKEY)
+      SDL_SetColorKey(scaled, SDL_SRCCOLORKEY, fmt->colorkey);
+
+   if(width == 0 || height == 0 || surface->w == 0 || surface->h == 0)
+      return scaled;
+
+   if(fmt->BytesPerPixel >= 3 && fmt->palette == NULL) {
+      // One byte per channel: the bytes can be processed independently.
+      scale_pixels(surface, scaled);
+      return scaled;
+   }
+
+   // Palettes or packed pixels: go via 32 bits per pixel.
+   SDL_Surface *dst32 =
+      SDL_CreateRGBSurface(SDL_SWSURFACE, width, height, 32, 0x00ff0000,
+                           0x0000ff00, 0x000000ff, 0xff000000);
+   SDL_Surface *src32 =
+      dst32 ? SDL_ConvertSurface(surface, dst32->format, SDL_SWSURFACE) : NULL;
+   if(src32 == NULL || dst32 == NULL) {
+      nano_warn("cannot convert surface for scaling: %s", SDL_GetError());
+      if(src32)
+         SDL_FreeSurface(src32);
+      if(dst32)
+         SDL_FreeSurface(dst32);
+      return scaled;
+   }
+
+   scale_pixels(src32, dst32);
+   SDL_SetAlpha(dst32, 0, 0);
+   SDL_BlitSurface(dst32, NULL, scaled, NULL);
+   SDL_FreeSurface(src32);
+   SDL_FreeSurface(dst32);
+
+   return scaled;
+}
+
+/*
+ * Calculate the taps for scaling "n" source pixels to "m" destination
+ * pixels.
+ */
+void init_axis(struct axis *ax, int n, int m)
+{
+   // Box filter: destination pixel j covers the source interval
+   // [j * n / m, (j + 1) * n / m), which touches at most n / m + 2
+   // pixels. Bilinear filter: two pixels.
+   ax->max_taps = m < n ? n / m + 2 : 2;
+   ax->start = (int*)nano_malloc(m * sizeof(int));
+   ax->count = (int*)nano_malloc(m * sizeof(int));
+   ax->weights = (Sint16*)nano_malloc(m * ax->max_taps * sizeof(Sint16));
+
+   for(int j = 0; j < m; j++) {
+      Sint16 *w = ax->weights + j * ax->max_taps;
+      int sum = 0, count = 0;
+
+      if(m < n) {
+         // All in units of 1 / m source pixels: source pixel i covers
+         // [i * m, (i + 1) * m), destination pixel j [j * n, (j + 1) * n).
+         Sint64 x1 = (Sint64)j * n, x2 = (Sint64)(j + 1) * n;
+         ax->start[j] = x1 / m;
+         for(int i = ax->start[j]; (Sint64)i * m < x2; i++) {
+            int covered =
+               MIN(x2, (Sint64)(i + 1) * m) - MAX(x1, (Sint64)i * m);
+            w[count] = covered * WEIGHT_ONE / n;
+            sum += w[count++];
+         }
+      } else {
+         // The center of destination pixel j is at source position
+         // (j + 1/2) * n / m - 1/2, which is here multiplied by 2 * m.
+         Sint64 x = (Sint64)(2 * j + 1) * n - m;
+         if(x <= 0)
+            ax->start[j] = 0;
+         else if(x >= (Sint64)2 * m * (n - 1))
+            ax->start[j] = n - 1;
+         else {
+            ax->start[j] = x / (2 * m);
+            int frac = x % (2 * m) * WEIGHT_ONE / (2 * m);
+            if(frac > 0) {
+               w[count] = WEIGHT_ONE - frac;
+               sum += w[count++];
+            }
+         }
+
+         // The next pixel (or the only one) gets the remaining weight
+         // below.
+         w[count++] = 0;
+      }
+
+      // Rounding errors go into the last tap, so that the weights sum
+      // up to exactly 1.
+      w[count - 1] += WEIGHT_ONE - sum;
+      ax->count[j] = count;
+   }
+}
+
+void free_axis(struct axis *ax)
+{
+   free(ax->start);
+   free(ax->count);
+   free(ax->weights);
+}
+
+/*
+ * Scale the pixels of "src" into "dst"; both have the same format with
+ * 3 or 4 bytes per pixel.
+ */
+void scale_pixels(SDL_Surface *src, SDL_Surface *dst)
+{
+   struct scaling sc;
+   sc.src = src;
+   sc.dst = dst;
+   init_axis(&sc.hor, src->w, dst->w);
+   init_axis(&sc.ver, src->h, dst->h);
+
+   int num_bands = 1;
+   if(src->w * src->h + dst->w * dst->h >= MIN_PARALLEL_PIXELS)
+      num_bands = MAX(MIN(nano_workers_num() + 1, dst->h / MIN_BAND_ROWS), 1);
+
+   SDL_LockSurface(src);
+   SDL_LockSurface(dst);
+   nano_run_parallel(scale_band, &sc, num_bands);
+   SDL_UnlockSurface(src);
+   SDL_UnlockSurface(dst);
+
+   free_axis(&sc.hor);
+   free_axis(&sc.ver);
+}
+
+/*
+ * Scale one horizontal band of the destination; called by
+ * nano_run_parallel().
+ */
+void scale_band(void *data, int part, int num_parts)
+{
+   struct scaling *sc = (struct scaling*)data;
+   SDL_Surface *src = sc->src, *dst = sc->dst;
+   struct axis *hor = &sc->hor, *ver = &sc->ver;
+   int bpp = src->format->BytesPerPixel;
+   int y1 = dst->h * part / num_parts, y2 = dst->h * (part + 1) / num_parts;
+
+   Uint8 *row = (Uint8*)nano_malloc(src->w * bpp);
+   const Uint8 **rows =
+      (const Uint8**)nano_malloc(ver->max_taps * sizeof(Uint8*));
+
+   for(int y = y1; y < y2; y++) {
+      for(int k = 0; k < ver->count[y]; k++)
+         rows[k] = (Uint8*)src->pixels + (ver->start[y] + k) * src->pitch;
+      combine_rows(rows, ver->weights + y * ver->max_taps, ver->count[y],
+                   row, src->w * bpp);
+
+      Uint8 *dest = (Uint8*)dst->pixels + y * dst->pitch;
+      // With constant values for "bpp", the compiler creates a
+      // specialized version of scale_row() for each case.
+      if(bpp == 4)
+         scale_row(row, dest, hor, dst->w, 4);
+      else if(bpp == 3)
+         scale_row(row, dest, hor, dst->w, 3);
+      else
+         scale_row(row, dest, hor, dst->w, bpp);
+   }
+
+   free(row);
+   free(rows);
+}
+
+/*
+ * Vertical pass: dest[i] is the sum of rows[k][i], multiplied with
+ * weights[k], for all k < count.
+ */
+void combine_rows(const Uint8 **rows, const Sint16 *weights, int count,
+                  Uint8 *dest, int len)
+{
+   int i = 0;
+
+   if(count == 1) {
+      // Rows which are copied (or interpolated with weight 0).
+      memcpy(dest, rows[0], len);
+      return;
+   }
+
+#if defined(__SSE2__)
+   // 16 bytes at once. Two rows are interleaved, so that
+   // _mm_madd_epi16() multiplies and adds two values into 32 bits.
+   __m128i zero = _mm_setzero_si128();
+   __m128i round = _mm_set1_epi32(WEIGHT_ONE / 2);
+   for(; i + 16 <= len; i += 16) {
+      __m128i acc[4] = { round, round, round, round };
+      for(int k = 0; k < count; k += 2) {
+         // An odd number of rows: the last row is paired with itself,
+         // with weight 0.
+         int k2 = k + 1 < count ? k + 1 : k;
+         Sint16 w2 = k + 1 < count ? weights[k + 1] : 0;
+         __m128i w = _mm_set_epi16(w2, weights[k], w2, weights[k],
+                                   w2, weights[k], w2, weights[k]);
+         __m128i a = _mm_loadu_si128((const __m128i*)(rows[k] + i));
+         __m128i b = _mm_loadu_si128((const __m128i*)(rows[k2] + i));
+         __m128i a_lo = _mm_unpacklo_epi8(a, zero);
+         __m128i a_hi = _mm_unpackhi_epi8(a, zero);
+         __m128i b_lo = _mm_unpacklo_epi8(b, zero);
+         __m128i b_hi = _mm_unpackhi_epi8(b, zero);
+         acc[0] = _mm_add_epi32(acc[0], _mm_madd_epi16(
+                                   _mm_unpacklo_epi16(a_lo, b_lo), w));
+         acc[1] = _mm_add_epi32(acc[1], _mm_madd_epi16(
+                                   _mm_unpackhi_epi16(a_lo, b_lo), w));
+         acc[2] = _mm_add_epi32(acc[2], _mm_madd_epi16(
+                                   _mm_unpacklo_epi16(a_hi, b_hi), w));
+         acc[3] = _mm_add_epi32(acc[3], _mm_madd_epi16(
+                                   _mm_unpackhi_epi16(a_hi, b_hi), w));
+      }
+
+      __m128i lo = _mm_packs_epi32(_mm_srai_epi32(acc[0], WEIGHT_BITS),
+                                   _mm_srai_epi32(acc[1], WEIGHT_BITS));
+      __m128i hi = _mm_packs_epi32(_mm_srai_epi32(acc[2], WEIGHT_BITS),
+                                   _mm_srai_epi32(acc[3], WEIGHT_BITS));
+      _mm_storeu_si128((__m128i*)(dest + i), _mm_packus_epi16(lo, hi));
+   }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   // 8 bytes at once, widened to 32 bits.
+   for(; i + 8 <= len; i += 8) {
+      uint32x4_t acc_lo = vdupq_n_u32(0), acc_hi = vdupq_n_u32(0);
+      for(int k = 0; k < count; k++) {
+         uint16x8_t a = vmovl_u8(vld1_u8(rows[k] + i));
+         acc_lo = vmlal_n_u16(acc_lo, vget_low_u16(a), weights[k]);
+         acc_hi = vmlal_n_u16(acc_hi, vget_high_u16(a), weights[k]);
+      }
+      // Rounding shift, then narrowed (with saturation) to bytes.
+      uint16x8_t v = vcombine_u16(vqrshrn_n_u32(acc_lo, WEIGHT_BITS),
+                                  vqrshrn_n_u32(acc_hi, WEIGHT_BITS));
+      vst1_u8(dest + i, vqmovn_u16(v));
+   }
+#endif
+
+   // The rest (or everything, without SIMD).
+   for(; i < len; i++) {
+      int v = WEIGHT_ONE / 2;
+      for(int k = 0; k < count; k++)
+         v += weights[k] * rows[k][i];
+      dest[i] = v >> WEIGHT_BITS;
+   }
+}
+
+/*
+ * Horizontal pass, for "m" destination pixels with "bpp" bytes each.
+ */
+inline void scale_row(const Uint8 *src, Uint8 *dest, const struct axis *ax,
+                      int m, int bpp)
+{
+   for(int j = 0; j < m; j++) {
+      const Sint16 *w = ax->weights + j * ax->max_taps;
+      const Uint8 *p = src + ax->start[j] * bpp;
+      int v[4] = { WEIGHT_ONE / 2, WEIGHT_ONE / 2,
+                   WEIGHT_ONE / 2, WEIGHT_ONE / 2 };
+
+      for(int k = 0; k < ax->count[j]; k++, p += bpp)
+         for(int c = 0; c < bpp; c++)
+            v[c] += w[k] * p[c];
+
+      for(int c = 0; c < bpp; c++)
+         dest[c] = v[c] >> WEIGHT_BITS;
+      dest += bpp;
+   }
+}
@@ -21,10 +21,22 @@
  * Functions for strings. Most of them are 16-bit variants of the functions
  * defined in <string.h>. For convenience, "misc.h" defines aliases without
  * the "nano_" prefix.
+ *
+ * The conversions of whole buffers of 32-bit characters (for Unicode
+ * files, see "nanoglk/stream.c") process runs of ASCII characters and
+ * byte swapping with SSE2 (or NEON), when available.
  */
 
 #include "misc.h"
 
+#if defined(__SSE2__)
+#  include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#  include <arm_neon.h>
+#endif
+
+static void swap32(const void *src, int len, void *dest);
+
 int nano_strlen16(const Uint16 *text)
 {
    int n = 0;
@@ -84,6 +96,31 @@ Uint16 *nano_strrchr16(const Uint16 *s, Uint16 c)
    return NULL;
 }
 
+/*
+ * Like memchr(3), but for 32-bit values; "n" is the number of values.
+ */
+Uint32 *nano_memchr32(const Uint32 *s, Uint32 c, size_t n)
+{
+   size_t i = 0;
+
+#if defined(__SSE2__)
+   __m128i v = _mm_set1_epi32(c);
+   for(; i + 4 <= n; i += 4) {
+      __m128i w = _mm_loadu_si128((const __m128i*)(s + i));
+      int mask = _mm_movemask_epi8(_mm_cmpeq_epi32(w, v));
+      if(mask)
+         return (Uint32*)(s + i + __builtin_ctz(mask) / 4);
+   }
+#endif
+
+   for(; i < n; i++) {
+      if(s[i] == c)
+         return (Uint32*)(s + i);
+   }
+
+   return NULL;
+}
+
 /*
  * Converts UTF-8 to a 16-bit string, which is newly allocated (so the caller
  * has to free(3) the return value).
@@ -184,7 +221,7 @@ char *nano_strduputf8from16(const Uint16 *src)
             if(src[i] < (2 << (5 -j + (j + 1) * 6))) {
                dest[di++] = mask | src[i] >> ((j + 1) * 6);
                for(int k = j; k >= 0; k--)
-                  dest[di++] = 0x80 | ((src[i] >> (j * 6)) & 0x3f);
+                  dest[di++] = 0x80 | ((src[i] >> (k * 6)) & 0x3f);
                done = 1;
             }
          }
@@ -195,6 +232,194 @@ char *nano_strduputf8from16(const Uint16 *src)
    return dest;
 }
 
+/*
+ * Encode "len" characters as UTF-8 into "dest", which must have space for
+ * 4 * "len" bytes. Return the number of bytes. Characters beyond the
+ * Unicode range and surrogates (U+D800 to U+DFFF) become U+FFFD.
+ */
+int nano_utf8_encode(const Uint32 *src, int len, char *dest)
+{
+   int i = 0, n = 0;
+
+   while(i < len) {
+#if defined(__SSE2__)
+      // Runs of ASCII characters, 8 at once.
+      __m128i non_ascii = _mm_set1_epi32(~0x7f);
+      while(i + 8 <= len) {
+         __m128i a = _mm_loadu_si128((const __m128i*)(src + i));
+         __m128i b = _mm_loadu_si128((const __m128i*)(src + i + 4));
+         __m128i high = _mm_and_si128(_mm_or_si128(a, b), non_ascii);
+         if(_mm_movemask_epi8(_mm_cmpeq_epi32(high, _mm_setzero_si128()))
+            != 0xffff)
+            break;
+         __m128i w = _mm_packs_epi32(a, b);
+         _mm_storel_epi64((__m128i*)(dest + n), _mm_packus_epi16(w, w));
+         i += 8;
+         n += 8;
+      }
+      if(i == len)
+         break;
+#endif
+
+      Uint32 c = src[i++];
+      if(c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff))
+         c = 0xfffd;
+
+      if(c < 0x80)
+         dest[n++] = c;
+      else if(c < 0x800) {
+         dest[n++] = 0xc0 | (c >> 6);
+         dest[n++] = 0x80 | (c & 0x3f);
+      } else if(c < 0x10000) {
+         dest[n++] = 0xe0 | (c >> 12);
+         dest[n++] = 0x80 | ((c >> 6) & 0x3f);
+         dest[n++] = 0x80 | (c & 0x3f);
+      } else {
+         dest[n++] = 0xf0 | (c >> 18);
+         dest[n++] = 0x80 | ((c >> 12) & 0x3f);
+         dest[n++] = 0x80 | ((c >> 6) & 0x3f);
+         dest[n++] = 0x80 | (c & 0x3f);
+      }
+   }
+
+   return n;
+}
+
+/*
+ * Decode UTF-8 from "src" ("len" bytes) into at most "max" characters,
+ * and return the number of characters. Decoding stops before a sequence
+ * which is incomplete at the end of "src"; *used is set to the number of
+ * bytes decoded. Invalid bytes become U+FFFD, as do overlong forms,
+ * surrogates and values beyond U+10FFFF (then only the first byte is
+ * skipped).
+ */
+int nano_utf8_decode(const char *src, int len, Uint32 *dest, int max,
+                     int *used)
+{
+   const unsigned char *s = (const unsigned char*)src;
+   int i = 0, n = 0;
+
+   while(n < max && i < len) {
+#if defined(__SSE2__)
+      // Runs of ASCII characters, 16 at once.
+      __m128i zero = _mm_setzero_si128();
+      while(n + 16 <= max && i + 16 <= len) {
+         __m128i v = _mm_loadu_si128((const __m128i*)(s + i));
+         if(_mm_movemask_epi8(v))
+            break;
+         __m128i lo = _mm_unpacklo_epi8(v, zero);
+         __m128i hi = _mm_unpackhi_epi8(v, zero);
+         _mm_storeu_si128((__m128i*)(dest + n), _mm_unpacklo_epi16(lo, zero));
+         _mm_storeu_si128((__m128i*)(dest + n + 4),
+                          _mm_unpackhi_epi16(lo, zero));
+         _mm_storeu_si128((__m128i*)(dest + n + 8),
+                          _mm_unpacklo_epi16(hi, zero));
+         _mm_storeu_si128((__m128i*)(dest + n + 12),
+                          _mm_unpackhi_epi16(hi, zero));
+         i += 16;
+         n += 16;
+      }
+      if(n == max || i == len)
+         break;
+#endif
+
+      Uint32 c = s[i];
+      int k; // number of continuation bytes
+      if(c < 0x80)
+         k = 0;
+      else if((c & 0xe0) == 0xc0) {
+         k = 1;
+         c &= 0x1f;
+      } else if((c & 0xf0) == 0xe0) {
+         k = 2;
+         c &= 0x0f;
+      } else if(c >= 0xf0 && c <= 0xf4) {
+         k = 3;
+         c &= 0x07;
+      } else {
+         dest[n++] = 0xfffd;
+         i++;
+         continue;
+      }
+
+      int j;
+      for(j = 1; j <= k && i + j < len && (s[i + j] & 0xc0) == 0x80; j++)
+         c = (c << 6) | (s[i + j] & 0x3f);
+
+      // The smallest character which needs "k" continuation bytes.
+      static const Uint32 min[] = { 0, 0x80, 0x800, 0x10000 };
+
+      if(j > k && c >= min[k] && c <= 0x10ffff &&
+         !(c >= 0xd800 && c <= 0xdfff)) {
+         dest[n++] = c;
+         i += j;
+      } else if(j <= k && i + j == len)
+         // Incomplete; perhaps continued later.
+         break;
+      else {
+         dest[n++] = 0xfffd;
+         i++;
+      }
+   }
+
+   *used = i;
+   return n;
+}
+
+/*
+ * Encode "len" characters as UCS-4, big-endian, into "dest" (4 * "len"
+ * bytes).
+ */
+void nano_ucs4be_encode(const Uint32 *src, int len, char *dest)
+{
+   swap32(src, len, dest);
+}
+
+/*
+ * Decode "len" characters in UCS-4, big-endian, from "src" (4 * "len"
+ * bytes).
+ */
+void nano_ucs4be_decode(const char *src, int len, Uint32 *dest)
+{
+   swap32(src, len, dest);
+}
+
+/*
+ * Convert "len" 32-bit values between big-endian and the native byte
+ * order.
+ */
+void swap32(const void *src, int len, void *dest)
+{
+#if SDL_BYTEORDER == SDL_BIG_ENDIAN
+   memcpy(dest, src, len * 4);
+#else
+   const Uint8 *s = (const Uint8*)src;
+   Uint8 *d = (Uint8*)dest;
+   int i = 0;
+
+#  if defined(__SSE2__)
+   for(; i + 4 <= len; i += 4) {
+      __m128i v = _mm_loadu_si128((const __m128i*)(s + 4 * i));
+      // Swap the bytes within the 16-bit words, then the words.
+      v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+      v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(2, 3, 0, 1));
+      _mm_storeu_si128((__m128i*)(d + 4 * i), v);
+   }
+#  elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   for(; i + 4 <= len; i += 4)
+      vst1q_u8(d + 4 * i, vrev32q_u8(vld1q_u8(s + 4 * i)));
+#  endif
+
+   for(; i < len; i++) {
+      d[4 * i] = s[4 * i + 3];
+      d[4 * i + 1] = s[4 * i + 2];
+      d[4 * i + 2] = s[4 * i + 1];
+      d[4 * i + 3] = s[4 * i];
+   }
+#endif
+}
+
 /*
  * Replace occurences of "${var}" by the value of the environment variable
  * "var", in "src"; result is written in "dest", with "maxlen" characters
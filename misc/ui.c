@@ -209,67 +209,12 @@ void nano_parse_color(const char *s, SDL_Color *c)
    c->b = n & 0xff;
 }
 
-
-/*
- * Scale a surface.
- *
- * The algorithm is rather simple. If the scaled surface is smaller
- * (both width and height) than the original surface, each pixel in
- * the scaled surface is assigned a rectangle of pixels in the
- * original surface; the resulting pixel value (red, green, blue) is
- * simply the average of all pixel values. This is pretty fast and
- * leads to rather good results.
- *
- * Nothing special (like interpolation) is done when scaling up. For
- * nanoglk, this is rarely needed.
- */
-SDL_Surface *nano_scale_surface(SDL_Surface *surface,
-                                Uint16 width, Uint16 height)
-{
-   SDL_Surface *scaled =
-      SDL_CreateRGBSurface(surface->flags, width, height,
-                           surface->format->BitsPerPixel,
-                           surface->format->Rmask, surface->format->Gmask,
-                           surface->format->Bmask, surface->format->Amask);
-
-   // TODO actually nonsense in some cases
-   int bpp = surface->format->BytesPerPixel;
-   int *v = (int*)nano_malloc(bpp * sizeof(int));
-   
-   for(int x = 0; x < width; x++)
-      for(int y = 0; y < height; y++) {
-         int xo1 = x * surface->w / width;
-         int xo2 = MAX((x + 1) * surface->w / width, xo1 + 1);
-         int yo1 = y * surface->h / height;
-         int yo2 = MAX((y + 1) * surface->h / height, yo1 + 1);
-         int n = (xo2 - xo1) * (yo2 - yo1);
-         
-         for(int i = 0; i < bpp; i++)
-            v[i] = 0;
-         
-         for(int xo = xo1; xo < xo2; xo++)
-            for(int yo = yo1; yo < yo2; yo++) {
-               Uint8 *ps =
-                  (Uint8*)surface->pixels + yo * surface->pitch + xo * bpp;
-               for(int i = 0; i < bpp; i++)
-                  v[i] += ps[i];
-            }
-         
-         Uint8 *pd = (Uint8*)scaled->pixels + y * scaled->pitch + x * bpp;
-         for(int i = 0; i < bpp; i++)
-            pd[i] = v[i] / n;
-      }
-   
-   free(v);
-
-   return scaled;
-}
-
 void nano_fill_rect(SDL_Surface *surface, SDL_Color c,
                     int x, int y, int w, int h)
 {
    SDL_Rect r = { x, y, w, h };
    SDL_FillRect(surface, &r, SDL_MapRGB(surface->format, c.r, c.g, c.b));
+   nano_damage(x, y, w, h);
 }
 
 static void draw_hline(SDL_Surface *surface, SDL_Color c, int x, int y, int w)
@@ -420,7 +365,7 @@ static void message(SDL_Surface *surface, Uint16 **msg, Uint16 **btn,
    }
   
    free(t);
-   SDL_Flip(surface);
+   nano_update(surface);
 }
 
 /*
@@ -487,11 +432,151 @@ int nano_ask_yes_no(SDL_Surface *surface, Uint16 **msg, int default_answer,
       }
    }
 }
+/*
+ * The text edited by nano_input_text16(), measured and rendered. Both
+ * are kept during one call, and, when the text is changed, updated
+ * only around the changed characters (see input_line_update()), so
+ * that typing does not become slower as the line grows.
+ */
+struct input_line
+{
+   struct nano_metrics *m;
+   SDL_Color fg, bg;
+   int len;               // the number of characters
+   int *x;                /* "x[i]" is the width of the first i characters,
+                             i. e. the caret position before character i */
+   SDL_Surface *surface;  // the whole text, rendered; at least 1 pixel wide
+};
+
+/*
+ * Calculate "x[from + 1]" to "x[to]", from the widths of the single
+ * characters and the kerning (in the same way as nano_width16() does).
+ */
+static void input_line_measure(struct input_line *il, const Uint16 *text,
+                               int from, int to)
+{
+   for(int i = from; i < to; i++)
+      il->x[i + 1] = il->x[i] + nano_width16(il->m, text + i, 1) +
+         (i > 0 ? nano_kerning16(il->m, text[i - 1], text[i]) : 0);
+}
+
+static void input_line_init(struct input_line *il, const Uint16 *text,
+                            int max_len, struct nano_metrics *m,
+                            SDL_Color fg, SDL_Color bg)
+{
+   il->m = m;
+   il->fg = fg;
+   il->bg = bg;
+   il->len = strlen16(text);
+   il->x = (int*)nano_malloc((max_len + 1) * sizeof(int));
+   il->x[0] = 0;
+   input_line_measure(il, text, 0, il->len);
+
+   if(il->len > 0)
+      il->surface = nano_render16(m, text, il->len, fg, bg);
+   else {
+      // Rendered from a space, so that the surface has the same palette
+      // as the glyphs (see "glyph.c").
+      Uint16 space = ' ';
+      il->surface = nano_render16(m, &space, 1, fg, bg);
+      SDL_FillRect(il->surface, NULL, 0);
+   }
+   SDL_SetColorKey(il->surface, SDL_SRCCOLORKEY, 0);
+}
+
+static void input_line_free(struct input_line *il)
+{
+   free(il->x);
+   SDL_FreeSurface(il->surface);
+}
+
+/*
+ * Called after the text has been changed: the first "p" characters are
+ * unchanged, and the characters starting at "q_old" in the old text
+ * have been moved to "q_new" in the new text ("text").
+ */
+static void input_line_update(struct input_line *il, const Uint16 *text,
+                              int p, int q_old, int q_new)
+{
+   int len_old = il->len;
+   il->len = len_old - q_old + q_new;
+
+   // Rendered again are the changed characters, and one unchanged
+   // character on each side, since kerning and overhanging glyphs
+   // depend on the neighbours. The rest is copied.
+   int a = MAX(p - 1, 0), b = MIN(q_new + 1, il->len);
+   int b_old = b - q_new + q_old;
+   int x_tail_old = il->x[b_old], w_tail = il->x[len_old] - x_tail_old;
+
+   // The positions of the unchanged tail are only shifted.
+   memmove(il->x + b + 1, il->x + b_old + 1, (len_old - b_old) * sizeof(int));
+   input_line_measure(il, text, p, b);
+   for(int i = b + 1; i <= il->len; i++)
+      il->x[i] += il->x[b] - x_tail_old;
+
+   SDL_Surface *old = il->surface;
+   SDL_Surface *s =
+      SDL_CreateRGBSurface(SDL_SWSURFACE, MAX(il->x[il->len], 1), old->h,
+                           8, 0, 0, 0, 0);
+   if(s == NULL)
+      nano_fail("Cannot create surface: %s", SDL_GetError());
+   SDL_SetColors(s, old->format->palette->colors, 0,
+                 old->format->palette->ncolors);
+   SDL_FillRect(s, NULL, 0);
+   SDL_SetColorKey(s, SDL_SRCCOLORKEY, 0);
+
+   SDL_Rect r1 = { 0, 0, il->x[a], s->h };
+   SDL_Rect r2 = { 0, 0, il->x[a], s->h };
+   SDL_BlitSurface(old, &r1, s, &r2);
+
+   SDL_Rect r3 = { x_tail_old, 0, w_tail, s->h };
+   SDL_Rect r4 = { il->x[b], 0, w_tail, s->h };
+   SDL_BlitSurface(old, &r3, s, &r4);
+
+   if(b > a) {
+      SDL_Surface *t = nano_render16(il->m, text + a, b - a, il->fg, il->bg);
+      SDL_SetColorKey(t, SDL_SRCCOLORKEY, 0);
+      SDL_Rect r5 = { il->x[a] +
+                      (a > 0 ? nano_kerning16(il->m, text[a - 1], text[a]) : 0),
+                      0, t->w, t->h };
+      SDL_BlitSurface(t, NULL, s, &r5);
+      SDL_FreeSurface(t);
+   }
+
+   SDL_FreeSurface(old);
+   il->surface = s;
+}
+
+/*
+ * Show the visible part of the text, starting at "ox", in the input
+ * field; and the caret at "cx" (relative to the text), unless it is
+ * negative.
+ */
+static void input_line_draw(struct input_line *il, SDL_Surface *surface,
+                            int x, int y, int w, int h, int ox, int cx)
+{
+   SDL_Rect rs = { x, y, w, h };
+   SDL_FillRect(surface, &rs,
+                SDL_MapRGB(surface->format, il->bg.r, il->bg.g, il->bg.b));
+   nano_damage(x, y, w, h);
+
+   SDL_Rect r1 = { ox, 0, w, h };
+   SDL_Rect r2 = { x, y, w, h };
+   SDL_BlitSurface(il->surface, &r1, surface, &r2);
+
+   if(cx >= 0) {
+      SDL_Rect rc = { x + cx - ox, y, 1, h };
+      SDL_FillRect(surface, &rc,
+                   SDL_MapRGB(surface->format, il->fg.r, il->fg.g, il->fg.b));
+   }
+}
 
 /*
  * Lets the user input text. This function returns as soon as the user has input
  * something which is not processed here; this way, other keys (like UP and DOWN
- * for history) can be easily implemented. It should look like this:
+ * for history) can be easily implemented. (Key releases and modifier keys
+ * pressed alone are processed here, and simply ignored.) It should look like
+ * this:
  *
  *    int state = -1;
  *    while(...) {
@@ -515,7 +600,7 @@ int nano_ask_yes_no(SDL_Surface *surface, Uint16 **msg, int default_answer,
  *               to ASCII (127) or ISO-8859-1 (255) (a requirement defined by
  *               Glk)
  * - x, y, w, h  the area in which the input field is shown
- * - font        the font used for the text
+ * - m           the metrics of the font used for the text (see "glyph.c")
  * - fg, bg      foreground, background
  * - state       if not NULL, the state (scroll offset and cursor position) is
  *               stored here; should be initially set to -1; exact format is
@@ -523,56 +608,37 @@ int nano_ask_yes_no(SDL_Surface *surface, Uint16 **msg, int default_answer,
  */
 void nano_input_text16(SDL_Surface *surface, SDL_Event *event,
                        Uint16 *text, int max_len, int max_char,
-                       int x, int y, int w, int h, TTF_Font *font,
+                       int x, int y, int w, int h, struct nano_metrics *m,
                        SDL_Color fg, SDL_Color bg, int *state)
 {
    nano_trace("input_text16(..., %p, %d, %d, %d, %d, %d, %d, ...)",
               text, max_len, max_char, x, y, w, h);
 
-   int pos = strlen16(text);
-   Uint16 *text_part = (Uint16*)nano_malloc((max_len + 1) * sizeof(Uint16*));
+   struct input_line il;
+   input_line_init(&il, text, max_len, m, fg, bg);
+
+   int pos = il.len;
    int ox = 0;
 
    if(state && *state != -1) {
-      pos = *state & 0x7fff;
+      pos = MIN(*state & 0x7fff, il.len);
       ox = *state >> 15;
    }
 
    while(1) {
-      int cx, c;
-
-      if(pos == 0)
-         cx = 0;
-      else {
-         memcpy(text_part, text, pos * sizeof(Uint16));
-         text_part[pos] = 0;
-         SDL_Surface *ts_part =
-            TTF_RenderUNICODE_Shaded(font, text_part, fg, bg);
-         cx = ts_part->w;
-         SDL_FreeSurface(ts_part);
-      }
-      
+      int cx = il.x[pos], c;
+
       if(cx > ox + w - 1)
          ox = cx - w + 1;
       else if(cx < ox)
          ox = cx;
 
-      SDL_Rect rs = { x, y, w, h };
-      SDL_FillRect(surface, &rs, SDL_MapRGB(surface->format, bg.r, bg.g, bg.b));
-
-      SDL_Surface *ts_total = TTF_RenderUNICODE_Shaded(font, text, fg, bg);
-      SDL_Rect r1 = { ox, 0, w, h };
-      SDL_Rect r2 = { x, y, w, h };
-      SDL_BlitSurface(ts_total, &r1, surface, &r2);
-      SDL_FreeSurface(ts_total);
-
-      SDL_Rect rc = { x + cx - ox, y, 1, h };
-      SDL_FillRect(surface, &rc, SDL_MapRGB(surface->format, fg.r, fg.g, fg.b));
-
-      SDL_Flip(surface);
+      input_line_draw(&il, surface, x, y, w, h, ox, cx);
+      nano_update(surface);
 
       nano_wait_event(event);
-      int len = strlen16(text);
+      int len = il.len;
+      int done = 0;
 
       switch(event->type) {
       case SDL_KEYDOWN:
@@ -591,14 +657,17 @@ void nano_input_text16(SDL_Surface *surface, SDL_Event *event,
             if(pos > 0) {
                memmove(text + pos - 1, text + pos,
                        sizeof(Uint16) * (len - pos + 1));
+               input_line_update(&il, text, pos - 1, pos, pos - 1);
                pos--;
             }
             break;
 
          case SDLK_DELETE:
-            if(text[pos])
+            if(text[pos]) {
                memmove(text + pos, text + pos + 1,
                        sizeof(Uint16) * (len - pos));
+               input_line_update(&il, text, pos, pos + 1, pos);
+            }
             break;
             
          case SDLK_HOME:
@@ -606,7 +675,7 @@ void nano_input_text16(SDL_Surface *surface, SDL_Event *event,
             break;
 
          case SDLK_END:
-            pos = strlen16(text);
+            pos = len;
             break;
             
          default:
@@ -616,45 +685,37 @@ void nano_input_text16(SDL_Surface *surface, SDL_Event *event,
                   memmove(text + pos + 1, text + pos,
                           sizeof(Uint16) * (len - pos + 1));
                   text[pos] = c;
+                  input_line_update(&il, text, pos, pos, pos + 1);
                   pos++;
                }
             }
-            else {
-               if(state)
-                  *state = pos | (ox << 15);
-
-               SDL_Rect rs = { x, y, w, h};
-               SDL_FillRect(surface, &rs, SDL_MapRGB(surface->format,
-                                                     bg.r, bg.g, bg.b));
-               ts_total = TTF_RenderUNICODE_Shaded(font, text, fg, bg);
-               SDL_Rect r1 = { ox, 0, w, h };
-               SDL_Rect r2 = { x, y, w, h };
-               SDL_BlitSurface(ts_total, &r1, surface, &r2);
-               SDL_FreeSurface(ts_total);
-               SDL_Flip(surface);
-
-               return;
-            }
+            else if(event->key.keysym.sym < SDLK_NUMLOCK ||
+                    event->key.keysym.sym > SDLK_COMPOSE)
+               // Modifier keys alone are ignored, like key releases
+               // below, so that the text is not measured and rendered
+               // again by the next call.
+               done = 1;
             break;
          }
          break;
+
+      case SDL_KEYUP:
+         break;
          
-         default:
-            if(state)
-               *state = pos | (ox << 15);
-
-            SDL_Rect rs = { x, y, w, h};
-            SDL_FillRect(surface, &rs, SDL_MapRGB(surface->format,
-                                                  bg.r, bg.g, bg.b));
-            ts_total = TTF_RenderUNICODE_Shaded(font, text, fg, bg);
-            SDL_Rect r1 = { ox, 0, w, h };
-            SDL_Rect r2 = { x, y, w, h };
-            SDL_BlitSurface(ts_total, &r1, surface, &r2);
-            SDL_FreeSurface(ts_total);
-            SDL_Flip(surface);
-
-            return;
+      default:
+         done = 1;
+         break;
+      }
+
+      if(done) {
+         if(state)
+            *state = pos | (ox << 15);
+
+         // Show the text without caret.
+         input_line_draw(&il, surface, x, y, w, h, ox, -1);
+         nano_update(surface);
+         input_line_free(&il);
+         return;
       }
    }
 }
-
@@ -0,0 +1,228 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A small pool of worker threads, for work which does not touch any
+ * state shared with the rest of the program (like scaling or decoding
+ * images).
+ *
+ * Jobs are started by nano_job_start() and processed in the order they
+ * were started. Each job must be waited for by nano_job_wait(); if the
+ * job has not yet been started by a worker, it is run by the waiting
+ * thread, so waiting is never slower than doing the work directly.
+ *
+ * Without workers (nano_workers_init() not called, or with 0 threads),
+ * nano_job_start() does nothing, and the job is run by nano_job_wait().
+ */
+
+#include "misc.h"
+
+enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE };
+
+struct nano_job
+{
+   void (*func)(void *data);
+   void *data;
+   int state;
+   struct nano_job *next;  // in the queue
+};
+
+struct parallel
+{
+   void (*func)(void *data, int part, int num_parts);
+   void *data;
+   int part, num_parts;
+};
+
+static int worker(void *data);
+static void run_part(void *data);
+
+static SDL_Thread **threads = NULL;
+static int num_threads = 0;
+static SDL_mutex *lock;
+static SDL_cond *work_cond;   // signalled when a job is queued, or at quit
+static SDL_cond *done_cond;   // signalled when a job is done
+static struct nano_job *first_job = NULL, *last_job = NULL;
+static int quit = FALSE;
+
+/*
+ * Start "num" worker threads.
+ */
+void nano_workers_init(int num)
+{
+   lock = SDL_CreateMutex();
+   work_cond = SDL_CreateCond();
+   done_cond = SDL_CreateCond();
+   threads = (SDL_Thread**)nano_malloc(MAX(num, 1) * sizeof(SDL_Thread*));
+
+   for(int i = 0; i < num; i++) {
+      if((threads[num_threads] = SDL_CreateThread(worker, NULL)))
+         num_threads++;
+      else
+         nano_warn("cannot create worker thread: %s", SDL_GetError());
+   }
+
+   nano_info("%d worker thread(s)", num_threads);
+}
+
+/*
+ * Stop all workers, after they have finished their current jobs. Jobs
+ * still in the queue are run by nano_job_wait().
+ */
+void nano_workers_quit(void)
+{
+   if(threads == NULL)
+      return;
+
+   SDL_LockMutex(lock);
+   quit = TRUE;
+   SDL_CondBroadcast(work_cond);
+   SDL_UnlockMutex(lock);
+
+   for(int i = 0; i < num_threads; i++)
+      SDL_WaitThread(threads[i], NULL);
+   free(threads);
+   threads = NULL;
+   num_threads = 0;
+}
+
+/*
+ * Return the number of worker threads.
+ */
+int nano_workers_num(void)
+{
+   return num_threads;
+}
+
+/*
+ * Start a job, which calls "func" with "data".
+ */
+struct nano_job *nano_job_start(void (*func)(void *data), void *data)
+{
+   struct nano_job *job =
+      (struct nano_job*)nano_malloc(sizeof(struct nano_job));
+   job->func = func;
+   job->data = data;
+   job->state = JOB_QUEUED;
+   job->next = NULL;
+
+   if(num_threads > 0) {
+      SDL_LockMutex(lock);
+      if(last_job)
+         last_job->next = job;
+      else
+         first_job = job;
+      last_job = job;
+      SDL_CondSignal(work_cond);
+      SDL_UnlockMutex(lock);
+   }
+
+   return job;
+}
+
+/*
+ * Wait until a job is done (or do it now), and free it.
+ */
+void nano_job_wait(struct nano_job *job)
+{
+   if(num_threads > 0) {
+      SDL_LockMutex(lock);
+      if(job->state == JOB_QUEUED) {
+         // Still in the queue: take it out.
+         struct nano_job *prev = NULL;
+         for(struct nano_job *j = first_job; j != job; j = j->next)
+            prev = j;
+         if(prev)
+            prev->next = job->next;
+         else
+            first_job = job->next;
+         if(last_job == job)
+            last_job = prev;
+      } else
+         while(job->state != JOB_DONE)
+            SDL_CondWait(done_cond, lock);
+      SDL_UnlockMutex(lock);
+   }
+
+   if(job->state == JOB_QUEUED)
+      job->func(job->data);
+   free(job);
+}
+
+/*
+ * Call "func" for the parts 0 to "num_parts" - 1, in parallel, and
+ * return when all are done. Part 0 is done by the calling thread.
+ */
+void nano_run_parallel(void (*func)(void *data, int part, int num_parts),
+                       void *data, int num_parts)
+{
+   struct parallel *p =
+      (struct parallel*)nano_malloc(num_parts * sizeof(struct parallel));
+   struct nano_job **jobs =
+      (struct nano_job**)nano_malloc(num_parts * sizeof(struct nano_job*));
+
+   for(int i = 1; i < num_parts; i++) {
+      p[i].func = func;
+      p[i].data = data;
+      p[i].part = i;
+      p[i].num_parts = num_parts;
+      jobs[i] = nano_job_start(run_part, &p[i]);
+   }
+
+   func(data, 0, num_parts);
+
+   for(int i = 1; i < num_parts; i++)
+      nano_job_wait(jobs[i]);
+
+   free(p);
+   free(jobs);
+}
+
+int worker(void *data)
+{
+   SDL_LockMutex(lock);
+   while(TRUE) {
+      while(first_job == NULL && !quit)
+         SDL_CondWait(work_cond, lock);
+      if(quit)
+         break;
+
+      struct nano_job *job = first_job;
+      first_job = job->next;
+      if(first_job == NULL)
+         last_job = NULL;
+      job->state = JOB_RUNNING;
+
+      SDL_UnlockMutex(lock);
+      job->func(job->data);
+      SDL_LockMutex(lock);
+
+      job->state = JOB_DONE;
+      SDL_CondBroadcast(done_cond);
+   }
+   SDL_UnlockMutex(lock);
+
+   return 0;
+}
+
+void run_part(void *data)
+{
+   struct parallel *p = (struct parallel*)data;
+   p->func(p->data, p->part, p->num_parts);
+}
@@ -15,6 +15,9 @@
 
 #include "nanoglk.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 /* We'd like to be able to deal with game files in Blorb files, even
    if we never load a sound or image. We'd also like to be able to
    deal with Data chunks. So we're willing to set a map here. */
@@ -31,6 +34,11 @@ giblorb_err_t giblorb_set_resource_map(strid_t file)
       nanoglk_log("giblorb_set_resource_map(%p) => %d", file, err);
       return err;
    }
+
+   giblorb_set_memory_limit(blorbmap, nanoglk_blorb_memory);
+
+   if(nanoglk_image_preload)
+      nanoglk_image_start_preload();
    
    return giblorb_err_None;
 }
@@ -40,3 +48,46 @@ giblorb_map_t *giblorb_get_resource_map()
    nanoglk_log("giblorb_get_resource_map() => %p", blorbmap);
    return blorbmap;
 }
+
+/*
+ * The file of a file stream is mapped into memory, so that
+ * giblorb_method_Memory does not need to copy chunks (see
+ * "glk/gi_blorb.c"). Not an original part of CheapGlk.
+ *
+ * The mapping is private and writable: like the copies made before,
+ * chunks may be changed by the caller, but pages are only copied when
+ * this happens. When the stream itself is already mapped (see
+ * "stream.c"), its buffer is used.
+ */
+void *giblorb_map_stream(strid_t file, glui32 *len)
+{
+   if(file->type != streamtype_File && file->type != streamtype_File_Uni)
+      return NULL;
+
+   if(file->x.file.mapped) {
+      *len = file->x.file.len;
+      return file->x.file.buf;
+   }
+
+   struct stat st;
+   int fd = file->x.file.fd;
+   if(fstat(fd, &st) != 0 || st.st_size == 0 || st.st_size > 0xffffffffL)
+      return NULL;
+
+   void *ptr =
+      mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   if(ptr == MAP_FAILED) {
+      nano_warn("cannot map blorb file into memory");
+      return NULL;
+   }
+
+   *len = st.st_size;
+   return ptr;
+}
+
+void giblorb_unmap_stream(strid_t file, void *ptr, glui32 len)
+{
+   // The buffer of a mapped stream is unmapped when the stream is closed.
+   if(!(file->x.file.mapped && file->x.file.buf == ptr))
+      munmap(ptr, len);
+}
@@ -175,6 +175,7 @@ glui32 glk_fileref_get_rock(frefid_t fref)
 void glk_fileref_delete_file(frefid_t fref)
 {
    nanoglk_log("glk_fileref_delete_file(%p)", fref);
+   nanoglk_stream_wait_written(fref->name);
    unlink(fref->name);
 }
 
@@ -182,6 +183,7 @@ glui32 glk_fileref_does_file_exist(frefid_t fref)
 {
    // Could check errno, but for practical usage, this should be sufficient.
    struct stat sb;
+   nanoglk_stream_wait_written(fref->name);
    int exists = stat(fref->name, &sb) == 0;
    nanoglk_log("glk_fileref_does_file_exist(%p) => %d", fref, exists);
    return exists;
@@ -26,13 +26,76 @@
  * in the same way, but glk_image_get_info() does not know of any
  * window.
  *
- * TODO: Caching images would probably improve performance.
+ * Images are cached after they have been decoded, scaled and converted
+ * into the format of the screen, for each size separately. The memory
+ * used is limited by nanoglk_image_cache_memory; when exceeded, the
+ * least recently used images are removed.
+ *
+ * The original sizes of the images are kept in a table for the current
+ * resource map. They are read from the headers of PNG (IHDR) and JPEG
+ * (SOF) pictures, so that glk_image_get_info() does not have to decode
+ * the image; only when this fails, the image is decoded.
+ *
+ * Optionally (nanoglk_image_preload), all images are decoded by the
+ * worker threads in advance, as soon as the resource map is set, as
+ * long as they fit into the cache memory. get_image() then takes the
+ * decoded image (waiting for the worker, if necessary).
  */
 
 #include "nanoglk.h"
 #include "SDL/SDL_image.h"
 
+struct cached_image
+{
+   glui32 image;
+   SDL_Surface *surface;      // converted and scaled
+   size_t bytes;
+   struct cached_image *prev, *next; // most recently used first
+};
+
+static struct cached_image *first_cached = NULL, *last_cached = NULL;
+static size_t cache_bytes = 0;
+
+struct image_size
+{
+   glui32 w, h;               // 0 x 0: not yet known
+};
+
+static giblorb_map_t *sizes_map = NULL; // the map "sizes" belongs to
+static struct image_size *sizes = NULL; // indexed by the image number
+static glui32 num_sizes = 0;
+
+struct preloaded_image
+{
+   glui32 image;
+   giblorb_map_t *map;
+   glui32 chunknum;           // retained until the job is done
+   const void *data;          // the chunk, as loaded by giblorb
+   glui32 length;
+   SDL_Surface *surface;      // decoded by the job, or NULL
+   struct nano_job *job;
+   struct preloaded_image *next;
+};
+
+static struct preloaded_image *first_preloaded = NULL;
+
+static SDL_Surface *get_image(glui32 image, glui32 w, glui32 h);
+static int get_orig_size(glui32 image, glui32 *w, glui32 *h);
+static struct image_size *find_size(glui32 image);
+static int read_png_size(const Uint8 *data, glui32 len, glui32 *w, glui32 *h);
+static int read_jpeg_size(const Uint8 *data, glui32 len,
+                          glui32 *w, glui32 *h);
+static struct cached_image *find_cached(glui32 image, glui32 w, glui32 h);
+static void link_cached(struct cached_image *ci);
+static void unlink_cached(struct cached_image *ci);
+static void add_cached(glui32 image, SDL_Surface *surface);
+static void flush_cached(void);
+static SDL_Surface *take_preloaded(glui32 image);
+static void preload_job(void *data);
+static void drop_preloaded(void);
 static SDL_Surface *load_image(glui32 image);
+static SDL_Surface *decode_image(glui32 image, const void *data,
+                                 glui32 length);
 static int get_scaled_image_size(glui32 *w, glui32 *h);
 static glui32 draw_image(winid_t win, glui32 image, glui32 w, glui32 h,
                          glsi32 val1, glsi32 val2);
@@ -57,15 +120,8 @@ glui32 glk_image_draw_scaled(winid_t win, glui32 image,
 
 glui32 glk_image_get_info(glui32 image, glui32 *width, glui32 *height)
 {
-   SDL_Surface *img = load_image(image);
-   if(img) {
-      *width = img->w;
-      *height = img->h;
-      if(get_scaled_image_size(width, height))
-         nano_trace("glk_image_info: scaled down form %d x %d to %d x %d",
-                    img->w, img->h, *width, *height);
-      SDL_FreeSurface(img);
-         
+   if(get_orig_size(image, width, height)) {
+      get_scaled_image_size(width, height);
       nanoglk_log("glk_image_get_info(%d, ..., ...) => %d x %d",
                   image, *width, *height);
       return 1;
@@ -75,28 +131,385 @@ glui32 glk_image_get_info(glui32 image, glui32 *width, glui32 *height)
    }
 }
 
+/*
+ * Return an image with the size "w" x "h" (or the original size, for
+ * -1), which is possibly scaled down to fit on the screen (see
+ * get_scaled_image_size()). The surface is taken from the cache, or
+ * decoded, scaled and added to the cache. It belongs to the cache; use
+ * the reference count to keep it. Return NULL if something fails.
+ */
+SDL_Surface *get_image(glui32 image, glui32 w, glui32 h)
+{
+   // The original size is needed to determine the size.
+   glui32 orig_w, orig_h;
+   if(!get_orig_size(image, &orig_w, &orig_h))
+      return NULL;
+
+   if(w == -1)
+      w = orig_w;
+   if(h == -1)
+      h = orig_h;
+   if(get_scaled_image_size(&w, &h))
+      nano_trace("image %d: scaled down to %d x %d", image, w, h);
+
+   struct cached_image *ci = find_cached(image, w, h);
+   if(ci) {
+      // Most recently used now.
+      unlink_cached(ci);
+      link_cached(ci);
+      return ci->surface;
+   }
+
+   SDL_Surface *img = take_preloaded(image);
+   if(img == NULL && (img = load_image(image)) == NULL)
+      return NULL;
+
+   // Converted before scaling, so that the scaled surface (which keeps
+   // the format) can be blitted directly.
+   SDL_Surface *conv =
+      img->format->Amask ? SDL_DisplayFormatAlpha(img) : SDL_DisplayFormat(img);
+   SDL_FreeSurface(img);
+   if(conv == NULL) {
+      nano_warn("cannot convert image %d: %s", image, SDL_GetError());
+      return NULL;
+   }
+
+   if(w != conv->w || h != conv->h) {
+      SDL_Surface *scaled = nano_scale_surface(conv, w, h);
+      SDL_FreeSurface(conv);
+      conv = scaled;
+   }
+
+   add_cached(image, conv);
+   return conv;
+}
+
+/*
+ * Determine the original size of an image, preferably from the header,
+ * without decoding it. Return 0 if something fails.
+ */
+int get_orig_size(glui32 image, glui32 *w, glui32 *h)
+{
+   struct image_size *size = find_size(image);
+   if(size && size->w > 0 && size->h > 0) {
+      *w = size->w;
+      *h = size->h;
+      return 1;
+   }
+
+   giblorb_result_t res;
+   if(giblorb_load_resource(giblorb_get_resource_map(), giblorb_method_Memory,
+                            &res, giblorb_ID_Pict, image) == giblorb_err_None
+      && (read_png_size(res.data.ptr, res.length, w, h) ||
+          read_jpeg_size(res.data.ptr, res.length, w, h)))
+      nano_trace("image %d: %d x %d, from header", image, *w, *h);
+   else {
+      // Unknown format or broken header: decode the whole image.
+      SDL_Surface *img = load_image(image);
+      if(img == NULL)
+         return 0;
+      *w = img->w;
+      *h = img->h;
+      SDL_FreeSurface(img);
+      nano_trace("image %d: %d x %d, decoded", image, *w, *h);
+   }
+
+   if(size) {
+      size->w = *w;
+      size->h = *h;
+   }
+   return 1;
+}
+
+/*
+ * Return the entry in the table of original sizes, which is created
+ * again when the resource map has changed; the cache is then emptied,
+ * too, since the image numbers refer to other images. Return NULL for
+ * image numbers which are not in the map.
+ */
+struct image_size *find_size(glui32 image)
+{
+   giblorb_map_t *map = giblorb_get_resource_map();
+   if(map == NULL)
+      return NULL;
+
+   if(map != sizes_map) {
+      glui32 num, min, max;
+      if(sizes)
+         free(sizes);
+      sizes = NULL;
+      num_sizes = 0;
+      sizes_map = map;
+      flush_cached();
+
+      if(giblorb_count_resources(map, giblorb_ID_Pict, &num, &min, &max)
+         == giblorb_err_None && num > 0) {
+         num_sizes = max + 1;
+         sizes = (struct image_size*)
+            nano_malloc(num_sizes * sizeof(struct image_size));
+         memset(sizes, 0, num_sizes * sizeof(struct image_size));
+      }
+   }
+
+   return image < num_sizes ? &sizes[image] : NULL;
+}
+
+/*
+ * Read the size of a PNG image: the IHDR chunk must follow directly
+ * after the signature. Return 0 if this is not a PNG image.
+ */
+int read_png_size(const Uint8 *data, glui32 len, glui32 *w, glui32 *h)
+{
+   static const Uint8 signature[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a,
+                                       0x1a, 0x0a };
+   if(len < 24 || memcmp(data, signature, 8) != 0 ||
+      memcmp(data + 12, "IHDR", 4) != 0)
+      return 0;
+
+   *w = ((glui32)data[16] << 24) | (data[17] << 16) | (data[18] << 8) |
+      data[19];
+   *h = ((glui32)data[20] << 24) | (data[21] << 16) | (data[22] << 8) |
+      data[23];
+   return *w > 0 && *h > 0;
+}
+
+/*
+ * Read the size of a JPEG image from the first SOF segment. Return 0 if
+ * this is not a JPEG image, or if there is no SOF segment.
+ */
+int read_jpeg_size(const Uint8 *data, glui32 len, glui32 *w, glui32 *h)
+{
+   if(len < 4 || data[0] != 0xff || data[1] != 0xd8)
+      return 0;
+
+   glui32 i = 2;
+   while(i + 1 < len) {
+      if(data[i] != 0xff)
+         return 0;
+      Uint8 marker = data[i + 1];
+      i += 2;
+
+      if(marker == 0xff)
+         // Fill byte.
+         i--;
+      else if(marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8))
+         // TEM, RSTn and SOI have no length.
+         ;
+      else if(marker == 0xd9 || marker == 0xda)
+         // EOI or SOS: the image data starts, no SOF found.
+         return 0;
+      else {
+         if(i + 2 > len)
+            return 0;
+         glui32 seglen = (data[i] << 8) | data[i + 1];
+         if(seglen < 2)
+            return 0;
+
+         // SOF0 to SOF15, except DHT (c4), JPG (c8) and DAC (cc).
+         if(marker >= 0xc0 && marker <= 0xcf &&
+            marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            if(seglen < 7 || i + 7 > len)
+               return 0;
+            *h = (data[i + 3] << 8) | data[i + 4];
+            *w = (data[i + 5] << 8) | data[i + 6];
+            return *w > 0 && *h > 0;
+         }
+
+         i += seglen;
+      }
+   }
+
+   return 0;
+}
+
+/*
+ * Search an image with a given size in the cache.
+ */
+struct cached_image *find_cached(glui32 image, glui32 w, glui32 h)
+{
+   for(struct cached_image *ci = first_cached; ci; ci = ci->next)
+      if(ci->image == image && ci->surface->w == w && ci->surface->h == h)
+         return ci;
+   return NULL;
+}
+
+/*
+ * Insert an image at the beginning of the list, as most recently used
+ * one.
+ */
+void link_cached(struct cached_image *ci)
+{
+   ci->prev = NULL;
+   ci->next = first_cached;
+   if(first_cached)
+      first_cached->prev = ci;
+   else
+      last_cached = ci;
+   first_cached = ci;
+   cache_bytes += ci->bytes;
+}
+
+void unlink_cached(struct cached_image *ci)
+{
+   if(ci->prev)
+      ci->prev->next = ci->next;
+   else
+      first_cached = ci->next;
+   if(ci->next)
+      ci->next->prev = ci->prev;
+   else
+      last_cached = ci->prev;
+   cache_bytes -= ci->bytes;
+}
+
+/*
+ * Add an image as most recently used one, and remove the least recently
+ * used ones, as long as too much memory is used (but never the image
+ * just added). The cache takes over the reference of "surface".
+ */
+void add_cached(glui32 image, SDL_Surface *surface)
+{
+   struct cached_image *ci =
+      (struct cached_image*)nano_malloc(sizeof(struct cached_image));
+   ci->image = image;
+   ci->surface = surface;
+   ci->bytes = surface->pitch * surface->h;
+   link_cached(ci);
+
+   while(cache_bytes > nanoglk_image_cache_memory && last_cached != ci) {
+      struct cached_image *old = last_cached;
+      nano_trace("image %d (%d x %d) removed from cache",
+                 old->image, old->surface->w, old->surface->h);
+      unlink_cached(old);
+      SDL_FreeSurface(old->surface);
+      free(old);
+   }
+}
+
+/*
+ * Remove all images from the cache.
+ */
+void flush_cached(void)
+{
+   while(first_cached) {
+      struct cached_image *ci = first_cached;
+      unlink_cached(ci);
+      SDL_FreeSurface(ci->surface);
+      free(ci);
+   }
+}
+
+/*
+ * Start decoding the images of the current resource map in advance
+ * (see comment at the beginning of this file). Only used with worker
+ * threads.
+ */
+void nanoglk_image_start_preload(void)
+{
+   drop_preloaded();
+
+   giblorb_map_t *map = giblorb_get_resource_map();
+   glui32 num, min, max;
+   if(map == NULL || nano_workers_num() == 0 ||
+      giblorb_count_resources(map, giblorb_ID_Pict, &num, &min, &max)
+      != giblorb_err_None || num == 0)
+      return;
+
+#if SDL_VERSIONNUM(SDL_IMAGE_MAJOR_VERSION, SDL_IMAGE_MINOR_VERSION, \
+                   SDL_IMAGE_PATCHLEVEL) >= SDL_VERSIONNUM(1, 2, 10)
+   // Decoders may be loaded dynamically; do this here, not in parallel.
+   IMG_Init(IMG_INIT_JPG | IMG_INIT_PNG);
+#endif
+
+   size_t bytes = 0;
+   struct preloaded_image **last = &first_preloaded;
+   for(glui32 image = min; image <= max; image++) {
+      giblorb_result_t res;
+      glui32 w, h;
+      if(giblorb_load_resource(map, giblorb_method_Memory, &res,
+                               giblorb_ID_Pict, image) != giblorb_err_None ||
+         !get_orig_size(image, &w, &h))
+         continue;
+
+      // Roughly the size of the decoded image.
+      bytes += (size_t)w * h * 4;
+      if(bytes > nanoglk_image_cache_memory)
+         break;
+
+      struct preloaded_image *pi = (struct preloaded_image*)
+         nano_malloc(sizeof(struct preloaded_image));
+      pi->image = image;
+      pi->map = map;
+      pi->chunknum = res.chunknum;
+      giblorb_retain_chunk(map, res.chunknum);
+      pi->data = res.data.ptr;
+      pi->length = res.length;
+      pi->surface = NULL;
+      pi->next = NULL;
+      pi->job = nano_job_start(preload_job, pi);
+      *last = pi;
+      last = &pi->next;
+   }
+
+   nano_trace("preloading images, about %d bytes", (int)bytes);
+}
+
+/*
+ * Return an image which has been decoded in advance (and forget it), or
+ * NULL.
+ */
+SDL_Surface *take_preloaded(glui32 image)
+{
+   for(struct preloaded_image **pp = &first_preloaded; *pp;
+       pp = &(*pp)->next)
+      if((*pp)->image == image) {
+         struct preloaded_image *pi = *pp;
+         nano_job_wait(pi->job);
+         giblorb_release_chunk(pi->map, pi->chunknum);
+         *pp = pi->next;
+         SDL_Surface *surface = pi->surface;
+         free(pi);
+         return surface;
+      }
+
+   return NULL;
+}
+
+/*
+ * Called by a worker thread.
+ */
+void preload_job(void *data)
+{
+   struct preloaded_image *pi = (struct preloaded_image*)data;
+   pi->surface = decode_image(pi->image, pi->data, pi->length);
+}
+
+void drop_preloaded(void)
+{
+   while(first_preloaded) {
+      struct preloaded_image *pi = first_preloaded;
+      nano_job_wait(pi->job);
+      giblorb_release_chunk(pi->map, pi->chunknum);
+      if(pi->surface)
+         SDL_FreeSurface(pi->surface);
+      first_preloaded = pi->next;
+      free(pi);
+   }
+}
+
 /*
  * Load an image from the blorb and return a SDL surface. Return NULL if
  * something fails.
  */
 SDL_Surface *load_image(glui32 image)
 {
-   // TODO: Simle, but creating a temporary file is ugly.
-   char *file = tmpnam(NULL);
    giblorb_result_t res;
    giblorb_err_t err;
 
    if((err = giblorb_load_resource(giblorb_get_resource_map(),
                                    giblorb_method_Memory, &res, giblorb_ID_Pict,
                                    image)) == giblorb_err_None) {
-      FILE *f = fopen(file, "wb");
-      fwrite(res.data.ptr, 1, res.length, f);
-      fclose(f);
-
-      SDL_Surface *img = IMG_Load(file);
-      if(!img)
-         nano_warn("IMG_Load failed: %s\n", IMG_GetError());
-      return img;
+      return decode_image(image, res.data.ptr, res.length);
    } else {
       nano_warn("giblorb_load_resource(..., giblorb_method_Memory, ..., "
                 "giblorb_ID_Pict, %d) returned %d", image, err);
@@ -104,6 +517,20 @@ SDL_Surface *load_image(glui32 image)
    }
 }
 
+/*
+ * Decode an image directly from the chunk in memory. May be called by
+ * worker threads.
+ */
+SDL_Surface *decode_image(glui32 image, const void *data, glui32 length)
+{
+   // The SDL_RWops is closed by IMG_Load_RW().
+   SDL_RWops *rw = SDL_RWFromConstMem(data, length);
+   SDL_Surface *img = rw ? IMG_Load_RW(rw, 1) : NULL;
+   if(!img)
+      nano_warn("image %d: IMG_Load failed: %s\n", image, IMG_GetError());
+   return img;
+}
+
 /*
  * Determine whether an image must be scaled to fit on the screen (see
  * comment at the beginning of this file). If it must be scaled, the
@@ -140,22 +567,8 @@ int get_scaled_image_size(glui32 *w, glui32 *h)
 glui32 draw_image(winid_t win, glui32 image, glui32 w, glui32 h,
                   glsi32 val1, glsi32 val2)
 {
-   SDL_Surface *img = load_image(image);
-   if(img) {
-      if(w == -1)
-         w = img->w;
-      if(h == -1)
-         h = img->h;
-
-      SDL_Surface *drawn_img;
-      if(w != img->w || h != img->h || get_scaled_image_size(&w, &h)) {
-         nano_trace("glk_image_draw: scaled down from %d x %d to %d x %d",
-                    img->w, img->h, w, h);
-         drawn_img = nano_scale_surface(img, w, h);
-         SDL_FreeSurface(img);
-      } else
-         drawn_img = img;
-
+   SDL_Surface *drawn_img = get_image(image, w, h);
+   if(drawn_img) {
       glui32 ret;
       switch(win->wintype) {
       case wintype_TextBuffer:
@@ -174,7 +587,6 @@ glui32 draw_image(winid_t win, glui32 image, glui32 w, glui32 h,
          break;
       }
 
-      SDL_FreeSurface(drawn_img);
       return ret;
    } else
       return 0;
@@ -57,16 +57,45 @@ int nanoglk_screen_width, nanoglk_screen_height, nanoglk_screen_depth;
 /* size of file selection (compare to configuration tree) */
 int nanoglk_filesel_width, nanoglk_filesel_height;
 
+/* memory (in bytes) used for the preserved text of each text buffer window,
+   including scrollback (compare to configuration tree) */
+int nanoglk_scrollback_memory;
+
+/* memory (in bytes) used for cached images (compare to configuration
+   tree) */
+int nanoglk_image_cache_memory;
+
+/* memory (in bytes) used for chunks loaded from the blorb file, when it is
+   not mapped into memory (compare to configuration tree) */
+int nanoglk_blorb_memory;
+
+/* whether images are decoded in advance (compare to configuration tree) */
+int nanoglk_image_preload;
+
+/* whether the time spent in stream calls is measured, and the statistics
+   are printed at the end (compare to configuration tree) */
+int nanoglk_stream_statistics;
+
+/* whether saved games and transcripts are written by worker threads
+   (compare to configuration tree) */
+int nanoglk_write_behind;
+
+/* the input history of all text buffer windows (compare to configuration
+   tree) */
+struct nano_history *nanoglk_history;
+
 /* factors for window sizes (compare to configuration tree) */
 double nanoglk_factor_horizontal_fixed, nanoglk_factor_vertical_fixed;
 double nanoglk_factor_horizontal_proportional;
 double nanoglk_factor_vertical_proportional;
 
 static void log_line(void);
+static void log_glyph_stats(void);
 static void init_properties(void);
 
 static char *binname; // basename of argv[0], used for configuration
 static conf_t conf;   // the nanoglk configuration
+static int worker_threads; // number of worker threads
 
 // The standard configuration, which provides basicly useful values when
 // no configuration file is found.
@@ -83,6 +112,16 @@ static const char *std_conf[] = {
    "?.buffer.preformatted.font-family = DejaVuSansMono",
    "?.buffer.preformatted.font-size = 9",
    
+   "?.buffer.scrollback-memory = 1024",
+   "?.buffer.history-size = 100",
+
+   "?.image-cache-memory = 4096",
+   "?.image-preload = no",
+   "?.blorb-memory = 0",
+   "?.worker-threads = auto",
+   "?.stream-statistics = no",
+   "?.write-behind = no",
+
    "?.grid.?.font-family = DejaVuSansMono",
    "?.grid.?.font-size = 9",
    
@@ -142,6 +181,9 @@ int main(int argc, char *argv[])
    nano_init(argc, argv, TRUE);
    nano_register_key('q', glk_exit);
    nano_register_key('l', log_line);
+   nano_register_key('g', log_glyph_stats);
+   nano_register_key('s', nanoglk_stream_log_stats);
+   nano_set_fail_func(nanoglk_stream_flush_all);
 
    char *copy = strdup(argv[0]);
    binname = strdup(basename(copy));
@@ -172,6 +214,10 @@ int main(int argc, char *argv[])
    TTF_Init();
 
    init_properties();
+   nano_workers_init(worker_threads);
+   // Called before SDL_Quit().
+   atexit(nano_workers_quit);
+
    nanoglk_window_init(nanoglk_screen_width, nanoglk_screen_height,
                        nanoglk_screen_depth);
 
@@ -189,6 +235,10 @@ void glk_exit(void)
 {
    nanoglk_log("glk_exit()");
 
+   if(nanoglk_stream_statistics)
+      nanoglk_stream_log_stats();
+   nanoglk_stream_flush_all();
+
    // SDL_Quit is called automatically.
    nano_conf_free(conf);
    free(binname);
@@ -215,6 +265,15 @@ static void log_line(void)
              "--------------");
 }
 
+// Called when the user presses Alt+Ctrl+G.
+static void log_glyph_stats(void)
+{
+   long hits, misses;
+   nano_glyph_stats(&hits, &misses);
+   nano_info("glyph cache: %ld hits, %ld misses (%.1f%% hits)", hits, misses,
+             hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0);
+}
+
 /*
  * Create a new font wrapper, using data mainly from the configuration.
  */
@@ -230,11 +289,10 @@ static struct nanoglk_font *new_font(const char *path, const char *family,
    nano_parse_color(fg, &font->fg);
    nano_parse_color(bg, &font->bg);
 
-   // Determine dimensions by rendering.
-   SDL_Surface* t = TTF_RenderText_Shaded(font->font, " ", font->fg, font->bg);
-   font->space_width = t->w;
-   font->text_height = t->h;
-   SDL_FreeSurface(t);
+   // Determine dimensions from the glyph metrics.
+   font->metrics = nano_metrics_new(font->font);
+   font->space_width = font->metrics->advance[' '];
+   font->text_height = font->metrics->height;
 
    return font;
 }
@@ -378,6 +436,48 @@ void init_properties(void)
       = nano_parse_double(nano_conf_get(conf, path_fhp, "1"));
    nanoglk_factor_vertical_proportional
       = nano_parse_double(nano_conf_get(conf, path_fvp, "1"));
+
+   const char *path_scrollback[] =
+      { binname, "buffer", "scrollback-memory", NULL };
+   nanoglk_scrollback_memory =
+      1024 * nano_parse_int(nano_conf_get(conf, path_scrollback, "1024"));
+
+   const char *path_icache[] = { binname, "image-cache-memory", NULL };
+   nanoglk_image_cache_memory =
+      1024 * nano_parse_int(nano_conf_get(conf, path_icache, "4096"));
+
+   const char *path_bmem[] = { binname, "blorb-memory", NULL };
+   nanoglk_blorb_memory =
+      1024 * nano_parse_int(nano_conf_get(conf, path_bmem, "0"));
+
+   const char *path_preload[] = { binname, "image-preload", NULL };
+   nanoglk_image_preload =
+      strcmp(nano_conf_get(conf, path_preload, "no"), "yes") == 0;
+
+   // "auto": one thread for each further processor.
+   const char *path_threads[] = { binname, "worker-threads", NULL };
+   const char *threads = nano_conf_get(conf, path_threads, "auto");
+   if(strcmp(threads, "auto") == 0)
+      worker_threads = MAX(sysconf(_SC_NPROCESSORS_ONLN) - 1, 0);
+   else
+      worker_threads = MAX(nano_parse_int(threads), 0);
+
+   const char *path_sstats[] = { binname, "stream-statistics", NULL };
+   nanoglk_stream_statistics =
+      strcmp(nano_conf_get(conf, path_sstats, "no"), "yes") == 0;
+
+   const char *path_wbehind[] = { binname, "write-behind", NULL };
+   nanoglk_write_behind =
+      strcmp(nano_conf_get(conf, path_wbehind, "no"), "yes") == 0;
+
+   const char *path_hsize[] = { binname, "buffer", "history-size", NULL };
+   const char *path_hfile[] = { binname, "buffer", "history-file", NULL };
+   const char *hfile = nano_conf_get(conf, path_hfile, "");
+   char hfile_exp[FILENAME_MAX];
+   nano_expand_env(hfile, hfile_exp, FILENAME_MAX);
+   nanoglk_history =
+      nano_history_new(nano_parse_int(nano_conf_get(conf, path_hsize, "100")),
+                       hfile_exp[0] ? hfile_exp : NULL);
 }
 
 /*
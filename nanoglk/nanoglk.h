@@ -116,10 +116,24 @@ struct glk_stream_struct
           streamtype_Buffer, streamtype_Buffer_Uni } type;
    glui32 rock;
    gidispatch_rock_t disprock, arrrock;
+   glui32 readcount, writecount; // characters, see glk_stream_close()
 
    union {
       winid_t window;  // streamtype_Window
-      FILE *file;      // streamtype_File, streamtype_File_Uni
+      struct {
+         int fd;
+         char *buf;       // FILE_BUFFER_SIZE bytes, see "stream.c"
+         glui32 start;    // position of buf[0] within the file
+         int pos, len;    /* position within buf, and number of bytes read
+                             into buf, or still to be written */
+         int writing;     // whether buf contains bytes to be written
+         int text;        // text mode; for streamtype_File_Uni: UTF-8
+         int mapped;      /* buf is the whole file, mapped privately
+                             (len bytes), and start is 0 */
+         char *behind;    /* write-behind (see "stream.c"): name of the
+                             file, otherwise NULL */
+         int size;        // write-behind: allocated size of buf
+      } file;          // streamtype_File, streamtype_File_Uni
       struct {
          union { char *u8; glui32 *u32; } b;
          int pos, len;
@@ -147,6 +161,7 @@ struct glk_window_struct
    glui32 rock;
    gidispatch_rock_t disprock, arrrock;
    strid_t stream;                // the window stream
+   strid_t echo;                  // the echo stream, or NULL
 
    SDL_Color fg[style_NUMSTYLES]; /* The foreground colors for the styles of
                                      this window. See comment at the beginning
@@ -180,9 +195,11 @@ struct nanoglk_font
    TTF_Font *font;          
    SDL_Color fg, bg; /* foreground and background, in which text with this
                         font should be rendered */
-   int space_width;  /* width of a space (result of rendering); see new_font()
+   struct nano_metrics *metrics; /* for measuring text without rendering;
+                                    see "misc/glyph.c" */
+   int space_width;  /* width of a space (from the metrics); see new_font()
                         in "main.c" */
-   int text_height;  /* font height (result of rendering); see new_font() in
+   int text_height;  /* font height (from the metrics); see new_font() in
                         "main.c" */
 };
 
@@ -201,6 +218,13 @@ extern SDL_Color nanoglk_ui_list_a_fg_color, nanoglk_ui_list_a_bg_color;
 
 extern int nanoglk_screen_width, nanoglk_screen_height, nanoglk_screen_depth;
 extern int nanoglk_filesel_width, nanoglk_filesel_height;
+extern int nanoglk_scrollback_memory;
+extern int nanoglk_image_cache_memory;
+extern int nanoglk_image_preload;
+extern int nanoglk_blorb_memory;
+extern int nanoglk_stream_statistics;
+extern int nanoglk_write_behind;
+extern struct nano_history *nanoglk_history;
 extern SDL_Surface *nanoglk_surface;
 
 extern double nanoglk_factor_horizontal_fixed, nanoglk_factor_vertical_fixed;
@@ -220,7 +244,12 @@ void nanoglk_call_unregi_arr(void *array, glui32 len, char *typecode,
 
 void nanoglk_window_init(int width, int height, int depth);
 void nanoglk_window_put_char(winid_t win, glui32 c);
+void nanoglk_window_put_buffer(winid_t win, const unsigned char *buf,
+                               glui32 len);
+void nanoglk_window_put_buffer_uni(winid_t win, const glui32 *buf,
+                                   glui32 len);
 void nanoglk_window_flush_all(void);
+void nanoglk_window_unset_echo(strid_t str);
 glui32 nanoglk_window_get_char(winid_t win);
 glui32 nanoglk_window_get_char_uni(winid_t win);
 glui32 nanoglk_window_char_sdl_to_glk(SDL_keysym *keysym);
@@ -236,12 +265,36 @@ void nanoglk_wintextbuffer_clear(winid_t win);
 void nanoglk_wintextbuffer_resize(winid_t win, SDL_Rect *area);
 void nanoglk_wintextbuffer_flush(winid_t win);
 void nanoglk_wintextbuffer_put_char(winid_t win, glui32 c);
+void nanoglk_wintextbuffer_put_buffer(winid_t win, const unsigned char *buf,
+                                      glui32 len);
+void nanoglk_wintextbuffer_put_buffer_uni(winid_t win, const glui32 *buf,
+                                          glui32 len);
 void nanoglk_wintextbuffer_put_image(winid_t win, SDL_Surface *image,
                                      glsi32 val1, glsi32 val2);
 glui32 nanoglk_wintextbuffer_get_char_uni(winid_t win);
 glui32 nanoglk_wintextbuffer_get_line16(winid_t win, Uint16 *text,
                                         int max_len, int max_char);
 
+struct nanoglk_textstore *nanoglk_textstore_new(int width);
+void nanoglk_textstore_free(struct nanoglk_textstore *ts);
+void nanoglk_textstore_clear(struct nanoglk_textstore *ts);
+int nanoglk_textstore_width_word(const Uint16 *text, const glui32 *styles,
+                                 int len);
+int nanoglk_textstore_place(struct nanoglk_textstore *ts, int w,
+                            int space_styl, int *x);
+void nanoglk_textstore_add_word(struct nanoglk_textstore *ts,
+                                const Uint16 *text, const glui32 *styles,
+                                int len);
+void nanoglk_textstore_add_image(struct nanoglk_textstore *ts,
+                                 SDL_Surface *image);
+void nanoglk_textstore_add_break(struct nanoglk_textstore *ts, int height);
+void nanoglk_textstore_reflow(struct nanoglk_textstore *ts, int width);
+int nanoglk_textstore_num_lines(struct nanoglk_textstore *ts);
+int nanoglk_textstore_line_height(struct nanoglk_textstore *ts, int line);
+int nanoglk_textstore_line_width(struct nanoglk_textstore *ts, int line);
+void nanoglk_textstore_draw_line(struct nanoglk_textstore *ts, int line,
+                                 winid_t win, int y);
+
 void nanoglk_wintextgrid_init(winid_t win);
 void nanoglk_wintextgrid_free(winid_t win);
 void nanoglk_wintextgrid_clear(winid_t win);
@@ -268,7 +321,14 @@ void nanoglk_wingraphics_set_background_color(winid_t win, glui32 color);
 void nanoglk_wingraphics_put_image(winid_t win, SDL_Surface *image,
                                    glsi32 val1, glsi32 val2);
 
+void nanoglk_image_start_preload(void);
+
 strid_t nanoglk_stream_new(glui32 type, glui32 rock);
 void nanoglk_stream_set_current(strid_t str);
+void nanoglk_stream_log_stats(void);
+void nanoglk_stream_wait_written(const char *name);
+void nanoglk_stream_flush_all(void);
+void nanoglk_stream_echo_line(winid_t win, const void *buf, int uni,
+                              glui32 len);
 
 #endif // __NANOGLK_H__
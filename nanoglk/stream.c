@@ -20,15 +20,80 @@
 /*
  * Handling streams.
  *
- * TODO: Quite much, search for "TODO" in this file. Especially,
- * unicode file streams are handled the same way as non-unicode file
- * streams. (It has to be specified how they are stored. UTF-8?
- * Configurable? Detecting when opening an existing file for reading?)
+ * TODO: Quite much, search for "TODO" in this file.
+ *
+ * Unicode file streams are stored as UTF-8 in text mode, and as UCS-4
+ * (big-endian) in binary mode, as other Glk implementations do. For the
+ * latter, positions are counted in characters, not bytes. Characters
+ * are converted in blocks (see nano_utf8_encode() and friends in
+ * "misc/string.c").
+ *
+ * File streams do not use stdio, but have their own buffer, which is
+ * used either for reading or for writing (see "writing"). Switching
+ * between both, as well as seeking outside of the buffer, empties the
+ * buffer first (see file_flush()). Larger blocks are read and written
+ * directly. pread(2) and pwrite(2) are used, so the position of the
+ * file descriptor does not matter; the position of the stream is
+ * "start" + "pos".
+ *
+ * Files opened by glkunix_stream_open_pathname() (the story file) are
+ * read-only, and mapped into memory instead (see "mapped"): the buffer
+ * is then the whole file, so reading and seeking never need a system
+ * call.
+ *
+ * Saved games and transcripts, which are opened for writing, use
+ * "write-behind" (if configured; off by default): the whole file is kept in the buffer
+ * (see "behind"), and written by a worker thread when the stream is
+ * closed. The data is first written into a temporary file (which is
+ * created when the stream is opened, so that errors are noticed early),
+ * synchronized by fsync(2), and finally renamed, so that a crash never
+ * leaves a partly written file. Opening the same file again waits until
+ * the worker has finished, see nanoglk_stream_wait_written().
+ *
+ * Output into a window stream is passed on to the echo stream of the
+ * window (if set), in the same pieces (so buffers are passed as a whole,
+ * and file streams get them in bulk), together with style changes.
+ *
+ * For each stream type, the number of calls reading and writing, the
+ * number of characters, and (if "stream-statistics" is set) the time
+ * spent are counted; see nanoglk_stream_log_stats().
  */
 
 #include "nanoglk.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define FILE_BUFFER_SIZE 65536
+
+enum { STATS_READ, STATS_WRITE };
+
+struct stream_stats
+{
+   long calls, chars;
+   double secs;
+};
+
+// A file being written by a worker, see comment at the beginning.
+struct write_behind
+{
+   char *name, *buf;
+   int fd;
+   glui32 len;
+   int ok;
+   struct nano_job *job;
+   struct write_behind *next;
+};
+
 static strid_t first = NULL, last = NULL, current = NULL;
+static struct write_behind *first_written = NULL;
+
+static struct stream_stats stats[streamtype_Buffer_Uni + 1][2];
+static const char *type_name[streamtype_Buffer_Uni + 1] = {
+   "window", "file", "unicode file", "memory", "unicode memory" };
 
 static void put_char_uni(strid_t str, glui32 ch);
 static void put_string(strid_t str, char *s);
@@ -37,6 +102,29 @@ static void put_buffer(strid_t str, char *buf, glui32 len);
 static void put_buffer_uni(strid_t str, glui32 *buf, glui32 len);
 static void set_style(strid_t str, glui32 styl);
 static glsi32 get_char_uni(strid_t str);
+static double stats_start(void);
+static void count(strid_t str, int dir, glui32 n, double start);
+static glui32 get_line_uni(strid_t str, void *buf, int uni, glui32 len);
+static void mem_write(strid_t str, const void *data, int uni, glui32 len);
+static glui32 mem_read(strid_t str, void *data, int uni, glui32 len,
+                       int line);
+static strid_t open_fileref(frefid_t fileref, glui32 fmode, glui32 type,
+                            glui32 rock);
+static void start_write_behind(strid_t str);
+static void write_behind_job(void *data);
+static char *temp_name(const char *name);
+static void file_map(strid_t str);
+static int file_flush(strid_t str);
+static void file_write(strid_t str, const char *data, glui32 len);
+static void file_put_char(strid_t str, char c);
+static glui32 file_read(strid_t str, char *data, glui32 len);
+static glsi32 file_get_char(strid_t str);
+static int file_fill(strid_t str);
+static void file_write_uni(strid_t str, const glui32 *data, glui32 len);
+static glui32 file_read_uni(strid_t str, glui32 *data, glui32 len);
+static glsi32 file_get_char_uni(strid_t str);
+static void file_seek(strid_t str, glui32 pos);
+static int write_all(int fd, const char *data, glui32 len, glui32 pos);
 
 /*
  * Called by all functions creating a stream. Also by glk_window_open(),
@@ -47,21 +135,33 @@ strid_t nanoglk_stream_new(glui32 type, glui32 rock)
    strid_t str = (strid_t)nano_malloc(sizeof(struct glk_stream_struct));
    str->type = type;
    str->rock = rock;
+   str->readcount = str->writecount = 0;
 
    ADD(str);
    return str;
 }
 
 /*
- * Create a stream from a a standard C FILE.
+ * Create a file stream; "flags" are passed to open(2).
  */
-static strid_t new_file_stream(FILE *file, glui32 type, glui32 rock)
+static strid_t new_file_stream(const char *name, int flags, glui32 type,
+                               int text, glui32 rock)
 {
-   if(file == NULL)
+   nanoglk_stream_wait_written(name);
+
+   int fd = open(name, flags, 0666);
+   if(fd == -1)
       return NULL;
    else {
       strid_t str = nanoglk_stream_new(type, rock);
-      str->x.file = file;
+      str->x.file.fd = fd;
+      str->x.file.buf = (char*)nano_malloc(FILE_BUFFER_SIZE);
+      str->x.file.start = (flags & O_APPEND) ? lseek(fd, 0, SEEK_END) : 0;
+      str->x.file.pos = str->x.file.len = 0;
+      str->x.file.writing = FALSE;
+      str->x.file.text = text;
+      str->x.file.mapped = FALSE;
+      str->x.file.behind = NULL;
       return str;
       
       // TODO: There is certainly a reason, why all callers of new_file_stream()
@@ -78,7 +178,10 @@ static strid_t new_file_stream(FILE *file, glui32 type, glui32 rock)
 strid_t glkunix_stream_open_pathname(char *pathname, glui32 textmode, 
                                      glui32 rock)
 {
-   strid_t str = new_file_stream(fopen(pathname, "r"), streamtype_File, rock);
+   strid_t str = new_file_stream(pathname, O_RDONLY, streamtype_File,
+                                 textmode, rock);
+   if(str)
+      file_map(str);
    nanoglk_log("glkunix_stream_open_pathname('%s', %d, %d) => %p",
                pathname, textmode, rock, str);
    if(str)
@@ -87,33 +190,78 @@ strid_t glkunix_stream_open_pathname(char *pathname, glui32 textmode,
 }
 
 /*
- * Convert Glk mode into mode needed by fopen(3).
+ * Convert Glk mode into flags needed by open(2).
  */
-static char *conv_mode(glui32 fmode)
+static int conv_mode(glui32 fmode)
 {
    switch(fmode) {
    case filemode_Write:
-      return "w";
+      return O_WRONLY | O_CREAT | O_TRUNC;
 
    case filemode_Read:
-      return "r";
+      return O_RDONLY;
 
    case filemode_ReadWrite:
-      return "r+";
+      return O_RDWR | O_CREAT;
 
    case filemode_WriteAppend:
-      return "a";
+      return O_WRONLY | O_CREAT | O_APPEND;
 
    default:
       nano_fail("invalid file mode %d", fmode);
-      return NULL;
+      return 0;
    }
 }
 
+/*
+ * Create a write-behind stream (see comment at the beginning), which
+ * replaces the file "name" when closed.
+ */
+static strid_t new_behind_stream(const char *name, glui32 type, int text,
+                                 glui32 rock)
+{
+   nanoglk_stream_wait_written(name);
+
+   char *tmp = temp_name(name);
+   int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   free(tmp);
+   if(fd == -1)
+      return NULL;
+
+   strid_t str = nanoglk_stream_new(type, rock);
+   str->x.file.fd = fd;
+   str->x.file.buf = (char*)nano_malloc(FILE_BUFFER_SIZE);
+   str->x.file.size = FILE_BUFFER_SIZE;
+   str->x.file.start = 0;
+   str->x.file.pos = str->x.file.len = 0;
+   str->x.file.writing = TRUE; // never read
+   str->x.file.text = text;
+   str->x.file.mapped = FALSE;
+   str->x.file.behind = strdup(name);
+   return str;
+}
+
+/*
+ * Open a file stream for glk_stream_open_file() and
+ * glk_stream_open_file_uni().
+ */
+strid_t open_fileref(frefid_t fileref, glui32 fmode, glui32 type,
+                     glui32 rock)
+{
+   glui32 usage = fileref->usage & fileusage_TypeMask;
+   int text = fileref->usage & fileusage_TextMode;
+
+   if(nanoglk_write_behind && fmode == filemode_Write &&
+      (usage == fileusage_SavedGame || usage == fileusage_Transcript))
+      return new_behind_stream(fileref->name, type, text, rock);
+   else
+      return new_file_stream(fileref->name, conv_mode(fmode), type, text,
+                             rock);
+}
+
 strid_t glk_stream_open_file(frefid_t fileref, glui32 fmode, glui32 rock)
 {
-   strid_t str = new_file_stream(fopen(fileref->name, conv_mode(fmode)),
-                                 streamtype_File, rock);
+   strid_t str = open_fileref(fileref, fmode, streamtype_File, rock);
    nanoglk_log("glk_stream_open_file(%p ['%s'], %d, %d) => %p",
                fileref, fileref->name, fmode, rock, str);
    if(str)
@@ -123,8 +271,7 @@ strid_t glk_stream_open_file(frefid_t fileref, glui32 fmode, glui32 rock)
 
 strid_t glk_stream_open_file_uni(frefid_t fileref, glui32 fmode, glui32 rock)
 {
-   strid_t str = new_file_stream(fopen(fileref->name, conv_mode(fmode)),
-                                 streamtype_File_Uni, rock);
+   strid_t str = open_fileref(fileref, fmode, streamtype_File_Uni, rock);
    nanoglk_log("glk_stream_open_file_uni(%p ['%s'], %d, %d) => %p",
                fileref, fileref->name, fmode, rock, str);
    if(str)
@@ -171,10 +318,12 @@ strid_t glk_stream_open_memory_uni(glui32 *buf, glui32 buflen, glui32 fmode,
 void glk_stream_close(strid_t str, stream_result_t *result)
 {
    nanoglk_call_unregi_obj(str, gidisp_Class_Stream, str->disprock);
+   nanoglk_window_unset_echo(str);
 
-   // TODO: Bytes/characters are not yet count.
-   if(result)
-      result->readcount = result->writecount = 0;
+   if(result) {
+      result->readcount = str->readcount;
+      result->writecount = str->writecount;
+   }
 
    switch(str->type) {
    case streamtype_Window:
@@ -183,8 +332,17 @@ void glk_stream_close(strid_t str, stream_result_t *result)
 
    case streamtype_File:
    case streamtype_File_Uni:
-      fclose(str->x.file);
-      str->x.file = NULL;
+      if(str->x.file.behind) {
+         start_write_behind(str);
+         break;
+      }
+
+      file_flush(str);
+      close(str->x.file.fd);
+      if(str->x.file.mapped)
+         munmap(str->x.file.buf, str->x.file.len);
+      else
+         free(str->x.file.buf);
       break;
 
    case streamtype_Buffer:
@@ -245,16 +403,29 @@ void glk_stream_set_position(strid_t str, glsi32 pos, glui32 seekmode)
       break;
 
    case streamtype_File:
-   case streamtype_File_Uni: // TODO
-      {
-         int whence = 0;
-         switch(seekmode) {
-         case seekmode_Start: whence = SEEK_SET; break;
-         case seekmode_Current: whence = SEEK_CUR; break;
-         case seekmode_End: whence = SEEK_END; break;
-         default: nano_fail("unknown seekmode %d", seekmode);
-         }
-         fseek(str->x.file, pos, whence);
+   case streamtype_File_Uni:
+      if(str->type == streamtype_File_Uni && !str->x.file.text)
+         pos *= 4;
+
+      switch(seekmode) {
+      case seekmode_Start:
+         file_seek(str, pos);
+         break;
+
+      case seekmode_Current:
+         file_seek(str, str->x.file.start + str->x.file.pos + pos);
+         break;
+
+      case seekmode_End:
+         file_flush(str);
+         if(str->x.file.mapped || str->x.file.behind)
+            file_seek(str, str->x.file.len + pos);
+         else
+            file_seek(str, lseek(str->x.file.fd, 0, SEEK_END) + pos);
+         break;
+
+      default:
+         nano_fail("unknown seekmode %d", seekmode);
       }
       break;
          
@@ -280,8 +451,10 @@ glui32 glk_stream_get_position(strid_t str)
       break;
 
    case streamtype_File:
-   case streamtype_File_Uni: // TODO
-      ret = ftell(str->x.file);
+   case streamtype_File_Uni:
+      ret = str->x.file.start + str->x.file.pos;
+      if(str->type == streamtype_File_Uni && !str->x.file.text)
+         ret /= 4;
       break;
 
    case streamtype_Buffer:
@@ -363,14 +536,24 @@ void glk_put_char_stream_uni(strid_t str, glui32 ch)
  */
 void put_char_uni(strid_t str, glui32 ch)
 {
+   double t = stats_start();
+
    switch(str->type) {
    case streamtype_Window:
       nanoglk_window_put_char(str->x.window, ch);
+      if(str->x.window->echo)
+         put_char_uni(str->x.window->echo, ch);
       break;
 
    case streamtype_File:
-   case streamtype_File_Uni: // TODO
-      fputc(ch, str->x.file);
+      file_put_char(str, ch);
+      break;
+
+   case streamtype_File_Uni:
+      if(str->x.file.text && ch < 0x80)
+         file_put_char(str, ch);
+      else
+         file_write_uni(str, &ch, 1);
       break;
 
    case streamtype_Buffer:
@@ -385,6 +568,8 @@ void put_char_uni(strid_t str, glui32 ch)
       str->x.buf.pos++;
       break;
    }
+
+   count(str, STATS_WRITE, 1, t);
 }
 
 void glk_put_string(char *s)
@@ -418,8 +603,7 @@ void glk_put_string_stream_uni(strid_t str, glui32 *s)
  */
 void put_string(strid_t str, char *s)
 {
-   for(char *p = s; *p; p++)
-      put_char_uni(str, *p);
+   put_buffer(str, s, strlen(s));
 }
 
 /*
@@ -427,8 +611,10 @@ void put_string(strid_t str, char *s)
  */
 void put_string_uni(strid_t str, glui32 *s)
 {
-   for(glui32 *p = s; *p; p++)
-      put_char_uni(str, *p);
+   glui32 len = 0;
+   while(s[len])
+      len++;
+   put_buffer_uni(str, s, len);
 }
 
 void glk_put_buffer(char *buf, glui32 len)
@@ -458,21 +644,83 @@ void glk_put_buffer_stream_uni(strid_t str, glui32 *buf, glui32 len)
 }
 
 /*
- * Write a Latin-1 buffer into a stream.
+ * Write a Latin-1 buffer into a stream. All stream types get the buffer
+ * as a whole.
  */
 void put_buffer(strid_t str, char *buf, glui32 len)
 {
-   for(glui32 i = 0; i < len; i++)
-      put_char_uni(str, buf[i]);
+   double t = stats_start();
+
+   switch(str->type) {
+   case streamtype_Window:
+      nanoglk_window_put_buffer(str->x.window, (unsigned char*)buf, len);
+      if(str->x.window->echo)
+         put_buffer(str->x.window->echo, buf, len);
+      break;
+
+   case streamtype_File:
+      file_write(str, buf, len);
+      break;
+
+   case streamtype_File_Uni:
+      {
+         glui32 conv[256];
+         for(glui32 i = 0; i < len; i += 256) {
+            glui32 n = MIN(len - i, 256);
+            for(glui32 j = 0; j < n; j++)
+               conv[j] = (unsigned char)buf[i + j];
+            file_write_uni(str, conv, n);
+         }
+      }
+      break;
+
+   case streamtype_Buffer:
+   case streamtype_Buffer_Uni:
+      mem_write(str, buf, FALSE, len);
+      break;
+   }
+
+   count(str, STATS_WRITE, len, t);
 }
 
 /*
- * Write a unicode buffer into a stream.
+ * Write a unicode buffer into a stream. See put_buffer().
  */
 void put_buffer_uni(strid_t str, glui32 *buf, glui32 len)
 {
-   for(glui32 i = 0; i < len; i++)
-      put_char_uni(str, buf[i]);
+   double t = stats_start();
+
+   switch(str->type) {
+   case streamtype_Window:
+      nanoglk_window_put_buffer_uni(str->x.window, buf, len);
+      if(str->x.window->echo)
+         put_buffer_uni(str->x.window->echo, buf, len);
+      break;
+
+   case streamtype_File:
+      {
+         // Converted in blocks, written as a whole.
+         char conv[256];
+         for(glui32 i = 0; i < len; i += sizeof(conv)) {
+            glui32 n = MIN(len - i, sizeof(conv));
+            for(glui32 j = 0; j < n; j++)
+               conv[j] = buf[i + j];
+            file_write(str, conv, n);
+         }
+      }
+      break;
+
+   case streamtype_File_Uni:
+      file_write_uni(str, buf, len);
+      break;
+
+   case streamtype_Buffer:
+   case streamtype_Buffer_Uni:
+      mem_write(str, buf, TRUE, len);
+      break;
+   }
+
+   count(str, STATS_WRITE, len, t);
 }
 
 void glk_set_style(glui32 styl)
@@ -498,6 +746,8 @@ void set_style(strid_t str, glui32 styl)
    switch(str->type) {
    case streamtype_Window:
       nanoglk_set_style(str->x.window, styl);
+      if(str->x.window->echo)
+         set_style(str->x.window->echo, styl);
       break;
 
    case streamtype_File:
@@ -525,34 +775,44 @@ glsi32 glk_get_char_stream_uni(strid_t str)
 
 glsi32 get_char_uni(strid_t str)
 {
+   double t = stats_start();
+   glsi32 c = 0; // TODO error
+
    switch(str->type) {
    case streamtype_Window:
       nano_warn("glk_get_char_stream_uni not implemented for windows");
-      return 0;
+      break;
 
    case streamtype_File:
-   case streamtype_File_Uni: // TODO
-      return fgetc(str->x.file);
+      c = file_get_char(str);
+      break;
+
+   case streamtype_File_Uni:
+      c = file_get_char_uni(str);
+      break;
 
    case streamtype_Buffer:
       if(str->x.buf.b.u8 && str->x.buf.pos < str->x.buf.len)
-         return str->x.buf.b.u8[str->x.buf.pos++];
+         c = (unsigned char)str->x.buf.b.u8[str->x.buf.pos++];
       else
-         return -1;
+         c = -1;
+      break;
 
    case streamtype_Buffer_Uni:
       if(str->x.buf.b.u32 && str->x.buf.pos < str->x.buf.len)
-         return str->x.buf.b.u32[str->x.buf.pos++];
+         c = str->x.buf.b.u32[str->x.buf.pos++];
       else
-         return -1;
+         c = -1;
+      break;
    }
-   
-   // TODO error
-   return 0;
+
+   count(str, STATS_READ, c == -1 ? 0 : 1, t);
+   return c;
 }
 
 glui32 glk_get_buffer_stream(strid_t str, char *buf, glui32 len)
 {
+   double t = stats_start();
    glui32 n;
 
    switch(str->type) {
@@ -562,30 +822,26 @@ glui32 glk_get_buffer_stream(strid_t str, char *buf, glui32 len)
       break;
 
    case streamtype_File:
-   case streamtype_File_Uni: // TODO
-      n = fread(buf, sizeof(char), len, str->x.file);
+      n = file_read(str, buf, len);
       break;
 
-   case streamtype_Buffer:
-      n = 0;
-      for(glui32 i = 0;
-          i < len && str->x.buf.b.u8 && str->x.buf.pos < str->x.buf.len;
-          i++) {
-         buf[i] = str->x.buf.b.u8[str->x.buf.pos];
-         str->x.buf.pos++;
-         n++;
+   case streamtype_File_Uni:
+      {
+         // Read in blocks; characters beyond Latin-1 become '?'.
+         glui32 conv[256], m;
+         n = 0;
+         do {
+            m = file_read_uni(str, conv, MIN(len - n, 256));
+            for(glui32 i = 0; i < m; i++)
+               buf[n + i] = conv[i] < 256 ? conv[i] : '?';
+            n += m;
+         } while(m == 256 && n < len);
       }
       break;
 
+   case streamtype_Buffer:
    case streamtype_Buffer_Uni:
-      n = 0;
-      for(glui32 i = 0;
-          i < len && str->x.buf.b.u32 && str->x.buf.pos < str->x.buf.len;
-          i++) {
-         buf[i] = str->x.buf.b.u32[str->x.buf.pos];
-            str->x.buf.pos++;
-            n++;
-      }
+      n = mem_read(str, buf, FALSE, len, FALSE);
       break;
 
    default:
@@ -594,27 +850,671 @@ glui32 glk_get_buffer_stream(strid_t str, char *buf, glui32 len)
       break;
    }
 
+   count(str, STATS_READ, n, t);
    nanoglk_log("glk_get_buffer_stream(%p, ..., %d) => %d", str, len, n);
    return n;
 }
 
 glui32 glk_get_buffer_stream_uni(strid_t str, glui32 *buf, glui32 len)
 {
-   nanoglk_log("glk_get_buffer_stream_uni(%p, ..., %d) => ...", str, len);
-   nano_fail("glk_get_buffer_stream_uni not implemented");
-   return 0;
+   double t = stats_start();
+   glui32 n;
+
+   switch(str->type) {
+   case streamtype_Window:
+      nano_warn("glk_get_buffer_stream_uni not implemented for windows");
+      n = 0;
+      break;
+
+   case streamtype_File:
+      {
+         char conv[256];
+         glui32 m;
+         n = 0;
+         do {
+            m = file_read(str, conv, MIN(len - n, sizeof(conv)));
+            for(glui32 i = 0; i < m; i++)
+               buf[n + i] = (unsigned char)conv[i];
+            n += m;
+         } while(m == sizeof(conv) && n < len);
+      }
+      break;
+
+   case streamtype_File_Uni:
+      n = file_read_uni(str, buf, len);
+      break;
+
+   case streamtype_Buffer:
+   case streamtype_Buffer_Uni:
+      n = mem_read(str, buf, TRUE, len, FALSE);
+      break;
+
+   default:
+      nano_fail("glk_get_buffer_stream_uni: unknown stream type %d",
+                str->type);
+      n = 0;
+      break;
+   }
+
+   count(str, STATS_READ, n, t);
+   nanoglk_log("glk_get_buffer_stream_uni(%p, ..., %d) => %d", str, len, n);
+   return n;
 }
 
 glui32 glk_get_line_stream(strid_t str, char *buf, glui32 len)
 {
-   nanoglk_log("glk_get_line_stream(%p, ... %d) => ...", str, len);
-   nano_fail("glk_get_line_stream not implemented");
-   return 0;
+   glui32 n = get_line_uni(str, buf, FALSE, len);
+   nanoglk_log("glk_get_line_stream(%p, ... %d) => %d", str, len, n);
+   return n;
 }
 
 glui32 glk_get_line_stream_uni(strid_t str, glui32 *buf, glui32 len)
 {
-   nanoglk_log("glk_get_line_stream_uni(%p, ... %d) => ...", str, len);
-   nano_fail("glk_get_line_stream_uni not implemented");
-   return 0;
+   glui32 n = get_line_uni(str, buf, TRUE, len);
+   nanoglk_log("glk_get_line_stream_uni(%p, ... %d) => %d", str, len, n);
+   return n;
+}
+
+/*
+ * Read a line (including the newline) into "buf", which holds Latin-1
+ * ("uni" is FALSE) or unicode characters, and "len" - 1 characters at
+ * most, followed by a terminating 0. Return the number of characters.
+ */
+glui32 get_line_uni(strid_t str, void *buf, int uni, glui32 len)
+{
+   if(len == 0)
+      return 0;
+
+   double t = stats_start();
+   glui32 n = 0;
+
+   switch(str->type) {
+   case streamtype_Window:
+      nano_warn("glk_get_line_stream not implemented for windows");
+      break;
+
+   case streamtype_File:
+   case streamtype_File_Uni:
+      while(n < len - 1) {
+         glsi32 c = str->type == streamtype_File ?
+            file_get_char(str) : file_get_char_uni(str);
+         if(c == -1)
+            break;
+         if(uni)
+            ((glui32*)buf)[n++] = c;
+         else
+            ((char*)buf)[n++] = c < 256 ? c : '?';
+         if(c == '\n')
+            break;
+      }
+      break;
+
+   case streamtype_Buffer:
+   case streamtype_Buffer_Uni:
+      n = mem_read(str, buf, uni, len - 1, TRUE);
+      break;
+   }
+
+   if(uni)
+      ((glui32*)buf)[n] = 0;
+   else
+      ((char*)buf)[n] = 0;
+
+   count(str, STATS_READ, n, t);
+   return n;
+}
+
+/*
+ * Write a line, which has been read from a window, into its echo stream
+ * (if set), followed by a newline. "buf" contains "len" Latin-1 ("uni" is
+ * FALSE) or unicode characters.
+ */
+void nanoglk_stream_echo_line(winid_t win, const void *buf, int uni,
+                              glui32 len)
+{
+   if(win->echo) {
+      if(uni)
+         put_buffer_uni(win->echo, (glui32*)buf, len);
+      else
+         put_buffer(win->echo, (char*)buf, len);
+      put_char_uni(win->echo, '\n');
+   }
+}
+
+/*
+ * Print the statistics of all stream types to the log. Called when the
+ * user presses Ctrl+Alt+S, and at the end, when "stream-statistics" is
+ * set.
+ */
+void nanoglk_stream_log_stats(void)
+{
+   for(int i = 0; i <= streamtype_Buffer_Uni; i++) {
+      struct stream_stats *r = &stats[i][STATS_READ];
+      struct stream_stats *w = &stats[i][STATS_WRITE];
+      if(r->calls > 0 || w->calls > 0)
+         nano_info("%s streams: %ld reads (%ld chars, %.3f s), "
+                   "%ld writes (%ld chars, %.3f s)", type_name[i],
+                   r->calls, r->chars, r->secs, w->calls, w->chars, w->secs);
+   }
+}
+
+/*
+ * Return the current time, for measuring the time spent in a call,
+ * or 0, when "stream-statistics" is not set.
+ */
+double stats_start(void)
+{
+   if(nanoglk_stream_statistics) {
+      struct timespec ts;
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      return ts.tv_sec + ts.tv_nsec * 1e-9;
+   } else
+      return 0;
+}
+
+/*
+ * Count a call which has read or written ("dir") "n" characters, and
+ * started at "start" (see stats_start()).
+ */
+void count(strid_t str, int dir, glui32 n, double start)
+{
+   if(dir == STATS_READ)
+      str->readcount += n;
+   else
+      str->writecount += n;
+
+   struct stream_stats *s = &stats[str->type][dir];
+   s->calls++;
+   s->chars += n;
+   if(start != 0)
+      s->secs += stats_start() - start;
+}
+
+/*
+ * Write "len" characters, Latin-1 ("uni" is FALSE) or unicode, into a
+ * memory stream. Characters beyond the end of the buffer are discarded,
+ * but still counted in the position (as put_char_uni() does).
+ */
+void mem_write(strid_t str, const void *data, int uni, glui32 len)
+{
+   int pos = str->x.buf.pos;
+   str->x.buf.pos += len;
+   if(str->x.buf.b.u8 == NULL || pos < 0 || pos >= str->x.buf.len)
+      return;
+
+   glui32 n = MIN(len, (glui32)(str->x.buf.len - pos));
+
+   if(str->type == streamtype_Buffer) {
+      char *dest = str->x.buf.b.u8 + pos;
+      if(uni)
+         for(glui32 i = 0; i < n; i++)
+            dest[i] = ((const glui32*)data)[i];
+      else
+         memcpy(dest, data, n);
+   } else {
+      glui32 *dest = str->x.buf.b.u32 + pos;
+      if(uni)
+         memcpy(dest, data, n * sizeof(glui32));
+      else
+         for(glui32 i = 0; i < n; i++)
+            dest[i] = ((const unsigned char*)data)[i];
+   }
+}
+
+/*
+ * Read up to "len" characters from a memory stream into "data", which
+ * holds Latin-1 ("uni" is FALSE) or unicode characters. With "line",
+ * stop after a newline. Return the number of characters.
+ */
+glui32 mem_read(strid_t str, void *data, int uni, glui32 len, int line)
+{
+   int pos = str->x.buf.pos;
+   if(str->x.buf.b.u8 == NULL || pos < 0 || pos >= str->x.buf.len)
+      return 0;
+
+   glui32 n = MIN(len, (glui32)(str->x.buf.len - pos));
+
+   if(str->type == streamtype_Buffer) {
+      const char *src = str->x.buf.b.u8 + pos;
+      if(line) {
+         const char *nl = memchr(src, '\n', n);
+         if(nl)
+            n = nl - src + 1;
+      }
+
+      if(uni)
+         for(glui32 i = 0; i < n; i++)
+            ((glui32*)data)[i] = (unsigned char)src[i];
+      else
+         memcpy(data, src, n);
+   } else {
+      const glui32 *src = str->x.buf.b.u32 + pos;
+      if(line) {
+         const glui32 *nl =
+            (const glui32*)nano_memchr32((const Uint32*)src, '\n', n);
+         if(nl)
+            n = nl - src + 1;
+      }
+
+      if(uni)
+         memcpy(data, src, n * sizeof(glui32));
+      else
+         for(glui32 i = 0; i < n; i++)
+            ((char*)data)[i] = src[i] < 256 ? src[i] : '?';
+   }
+
+   str->x.buf.pos += n;
+   return n;
+}
+
+/*
+ * Wait until the file "name" (or all files, if "name" is NULL) written
+ * behind (see comment at the beginning) is written completely.
+ */
+void nanoglk_stream_wait_written(const char *name)
+{
+   struct write_behind **prev = &first_written;
+   while(*prev) {
+      struct write_behind *wb = *prev;
+      if(name == NULL || strcmp(wb->name, name) == 0) {
+         nano_job_wait(wb->job);
+         if(!wb->ok)
+            nano_warn("writing '%s' failed", wb->name);
+         *prev = wb->next;
+         free(wb->name);
+         free(wb->buf);
+         free(wb);
+      } else
+         prev = &wb->next;
+   }
+}
+
+/*
+ * Pass the data of a write-behind stream, which is closed, to a worker.
+ */
+void start_write_behind(strid_t str)
+{
+   // Also keeps the order of writing the same file.
+   nanoglk_stream_wait_written(str->x.file.behind);
+
+   struct write_behind *wb =
+      (struct write_behind*)nano_malloc(sizeof(struct write_behind));
+   wb->name = str->x.file.behind;
+   wb->buf = str->x.file.buf;
+   wb->fd = str->x.file.fd;
+   wb->len = str->x.file.len;
+   wb->ok = FALSE;
+   wb->next = first_written;
+   first_written = wb;
+
+   wb->job = nano_job_start(write_behind_job, wb);
+   if(nano_workers_num() == 0)
+      // Nobody else will do it.
+      nanoglk_stream_wait_written(wb->name);
+}
+
+/*
+ * Write the data of a write-behind stream. Runs in a worker thread, so
+ * nothing but "data" may be touched.
+ */
+void write_behind_job(void *data)
+{
+   struct write_behind *wb = (struct write_behind*)data;
+   char *tmp = temp_name(wb->name);
+
+   wb->ok = write_all(wb->fd, wb->buf, wb->len, 0) && fsync(wb->fd) == 0;
+   wb->ok = close(wb->fd) == 0 && wb->ok;
+   if(wb->ok)
+      wb->ok = rename(tmp, wb->name) == 0;
+   else
+      unlink(tmp);
+
+   free(tmp);
+}
+
+/*
+ * Return the name of the temporary file used for writing the file
+ * "name" behind. The caller has to free(3) it.
+ */
+char *temp_name(const char *name)
+{
+   char *tmp = (char*)nano_malloc(strlen(name) + 5);
+   sprintf(tmp, "%s.tmp", name);
+   return tmp;
+}
+
+/*
+ * Map the file of a new, read-only file stream into memory, which then
+ * replaces the buffer. If this is not possible (e. g. for an empty file),
+ * the buffer is used as usual.
+ */
+void file_map(strid_t str)
+{
+   struct stat st;
+   if(fstat(str->x.file.fd, &st) != 0 || st.st_size == 0 ||
+      st.st_size > 0x7fffffff)
+      return;
+
+   // Writable (but private) for the sake of giblorb_map_stream(), which
+   // may pass it on.
+   void *ptr = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    str->x.file.fd, 0);
+   if(ptr == MAP_FAILED)
+      return;
+
+   free(str->x.file.buf);
+   str->x.file.buf = (char*)ptr;
+   str->x.file.len = st.st_size;
+   str->x.file.mapped = TRUE;
+}
+
+/*
+ * Write the bytes still in the buffer of a file stream, or discard the
+ * bytes read in advance, so that the buffer is empty. The position of
+ * the stream is kept. Return FALSE, if writing failed. (Nothing to do
+ * for mapped files.)
+ */
+int file_flush(strid_t str)
+{
+   if(str->x.file.mapped || str->x.file.behind)
+      return TRUE;
+
+   int ok = TRUE;
+   if(str->x.file.writing && str->x.file.len > 0)
+      ok = write_all(str->x.file.fd, str->x.file.buf, str->x.file.len,
+                     str->x.file.start);
+
+   str->x.file.start += str->x.file.pos;
+   str->x.file.pos = str->x.file.len = 0;
+   str->x.file.writing = FALSE;
+   return ok;
+}
+
+void file_write(strid_t str, const char *data, glui32 len)
+{
+   if(str->x.file.mapped) {
+      nano_warn("writing into read-only file");
+      return;
+   }
+
+   if(str->x.file.behind) {
+      if(str->x.file.pos + len > str->x.file.size) {
+         str->x.file.size = MAX(2 * str->x.file.size, str->x.file.pos + len);
+         str->x.file.buf = (char*)realloc(str->x.file.buf, str->x.file.size);
+         nano_failunless(str->x.file.buf != NULL,
+                         "Cannot allocate %d bytes.", str->x.file.size);
+      }
+
+      memcpy(str->x.file.buf + str->x.file.pos, data, len);
+      str->x.file.pos += len;
+      str->x.file.len = MAX(str->x.file.len, str->x.file.pos);
+      return;
+   }
+
+   if(!str->x.file.writing) {
+      file_flush(str);
+      str->x.file.writing = TRUE;
+   }
+
+   if(str->x.file.pos + len > FILE_BUFFER_SIZE) {
+      file_flush(str);
+      if(len >= FILE_BUFFER_SIZE) {
+         // Large blocks are written directly.
+         write_all(str->x.file.fd, data, len, str->x.file.start);
+         str->x.file.start += len;
+         return;
+      }
+      str->x.file.writing = TRUE;
+   }
+
+   memcpy(str->x.file.buf + str->x.file.pos, data, len);
+   str->x.file.pos += len;
+   str->x.file.len = str->x.file.pos;
+}
+
+void file_put_char(strid_t str, char c)
+{
+   if(str->x.file.writing && str->x.file.pos < FILE_BUFFER_SIZE) {
+      str->x.file.buf[str->x.file.pos++] = c;
+      str->x.file.len = MAX(str->x.file.len, str->x.file.pos);
+   } else
+      file_write(str, &c, 1);
+}
+
+/*
+ * Read up to "len" bytes, and return the number of bytes actually
+ * read.
+ */
+glui32 file_read(strid_t str, char *data, glui32 len)
+{
+   if(str->x.file.behind)
+      return 0; // write-only
+
+   if(str->x.file.mapped) {
+      glui32 n = 0;
+      if(str->x.file.pos < str->x.file.len)
+         n = MIN(len, (glui32)(str->x.file.len - str->x.file.pos));
+      memcpy(data, str->x.file.buf + str->x.file.pos, n);
+      str->x.file.pos += n;
+      return n;
+   }
+
+   if(str->x.file.writing)
+      file_flush(str);
+
+   glui32 done = 0;
+   while(done < len) {
+      if(str->x.file.pos == str->x.file.len) {
+         // Buffer exhausted.
+         str->x.file.start += str->x.file.len;
+         str->x.file.pos = str->x.file.len = 0;
+
+         ssize_t n;
+         if(len - done >= FILE_BUFFER_SIZE) {
+            // Large blocks are read directly.
+            n = pread(str->x.file.fd, data + done, len - done,
+                      str->x.file.start);
+            if(n <= 0)
+               break;
+            str->x.file.start += n;
+            done += n;
+            continue;
+         }
+
+         n = pread(str->x.file.fd, str->x.file.buf, FILE_BUFFER_SIZE,
+                   str->x.file.start);
+         if(n <= 0)
+            break;
+         str->x.file.len = n;
+      }
+
+      int n = MIN(str->x.file.len - str->x.file.pos, len - done);
+      memcpy(data + done, str->x.file.buf + str->x.file.pos, n);
+      str->x.file.pos += n;
+      done += n;
+   }
+
+   return done;
+}
+
+/*
+ * Read one byte, or return -1 at the end of the file.
+ */
+glsi32 file_get_char(strid_t str)
+{
+   unsigned char c;
+   if(!str->x.file.writing && str->x.file.pos < str->x.file.len)
+      return (unsigned char)str->x.file.buf[str->x.file.pos++];
+   else
+      return file_read(str, (char*)&c, 1) == 1 ? c : -1;
+}
+
+/*
+ * Keep the bytes not yet read, and read more bytes behind them. Return
+ * FALSE at the end of the file. Used for decoding UTF-8, when a sequence
+ * is split at the end of the buffer.
+ */
+int file_fill(strid_t str)
+{
+   if(str->x.file.mapped)
+      return FALSE;
+
+   if(str->x.file.writing)
+      file_flush(str);
+
+   int rest = str->x.file.len - str->x.file.pos;
+   memmove(str->x.file.buf, str->x.file.buf + str->x.file.pos, rest);
+   str->x.file.start += str->x.file.pos;
+   str->x.file.pos = 0;
+   str->x.file.len = rest;
+
+   ssize_t n = pread(str->x.file.fd, str->x.file.buf + rest,
+                     FILE_BUFFER_SIZE - rest, str->x.file.start + rest);
+   if(n <= 0)
+      return FALSE;
+   str->x.file.len += n;
+   return TRUE;
+}
+
+/*
+ * Write unicode characters into a file stream, as UTF-8 or UCS-4, see
+ * comment at the beginning.
+ */
+void file_write_uni(strid_t str, const glui32 *data, glui32 len)
+{
+   char conv[4 * 256];
+   for(glui32 i = 0; i < len; i += 256) {
+      int n = MIN(len - i, 256);
+      if(str->x.file.text)
+         file_write(str, conv,
+                    nano_utf8_encode((const Uint32*)data + i, n, conv));
+      else {
+         nano_ucs4be_encode((const Uint32*)data + i, n, conv);
+         file_write(str, conv, 4 * n);
+      }
+   }
+}
+
+/*
+ * Read up to "len" unicode characters from a file stream, and return
+ * the number of characters actually read.
+ */
+glui32 file_read_uni(strid_t str, glui32 *data, glui32 len)
+{
+   glui32 done = 0;
+
+   if(str->x.file.behind)
+      return 0; // write-only
+
+   if(str->x.file.text) {
+      if(str->x.file.writing)
+         file_flush(str);
+
+      while(TRUE) {
+         int used;
+         done += nano_utf8_decode(str->x.file.buf + str->x.file.pos,
+                                  str->x.file.len - str->x.file.pos,
+                                  (Uint32*)data + done, len - done, &used);
+         str->x.file.pos += used;
+
+         // Otherwise, the buffer is exhausted, or ends within a sequence.
+         if(done == len)
+            break;
+
+         if(!file_fill(str)) {
+            if(str->x.file.pos < str->x.file.len) {
+               // Incomplete sequence at the end of the file.
+               data[done++] = 0xfffd;
+               str->x.file.pos = str->x.file.len;
+            }
+            break;
+         }
+      }
+   } else {
+      char conv[4 * 256];
+      glui32 n;
+      do {
+         n = file_read(str, conv, 4 * MIN(len - done, 256)) / 4;
+         nano_ucs4be_decode(conv, n, (Uint32*)data + done);
+         done += n;
+      } while(n == 256 && done < len);
+   }
+
+   return done;
+}
+
+/*
+ * Read one unicode character, or return -1 at the end of the file.
+ */
+glsi32 file_get_char_uni(strid_t str)
+{
+   glui32 c;
+   if(str->x.file.text && !str->x.file.writing &&
+      str->x.file.pos < str->x.file.len &&
+      (unsigned char)str->x.file.buf[str->x.file.pos] < 0x80)
+      return str->x.file.buf[str->x.file.pos++];
+   else
+      return file_read_uni(str, &c, 1) == 1 ? (glsi32)c : -1;
+}
+
+/*
+ * Set the position of a file stream. Within the bytes read in advance,
+ * the buffer is kept.
+ */
+void file_seek(strid_t str, glui32 pos)
+{
+   if(str->x.file.mapped || str->x.file.behind)
+      str->x.file.pos = MIN(pos, (glui32)str->x.file.len);
+   else if(!str->x.file.writing && pos >= str->x.file.start &&
+           pos <= str->x.file.start + str->x.file.len)
+      str->x.file.pos = pos - str->x.file.start;
+   else {
+      file_flush(str);
+      str->x.file.start = pos;
+   }
+}
+
+/*
+ * Write a block at a given position, even when pwrite(2) writes only a
+ * part of it. Return FALSE, if this fails.
+ */
+int write_all(int fd, const char *data, glui32 len, glui32 pos)
+{
+   while(len > 0) {
+      ssize_t n = pwrite(fd, data, len, pos);
+      if(n <= 0) {
+         nano_warn("writing into file failed");
+         return FALSE;
+      }
+      data += n;
+      len -= n;
+      pos += n;
+   }
+
+   return TRUE;
+}
+
+/*
+ * Write everything file streams still open have buffered. Called at the
+ * end (by glk_exit(), or when the program fails), since open streams are
+ * not closed then. Write-behind streams are written completely, and not
+ * usable anymore afterwards.
+ */
+void nanoglk_stream_flush_all(void)
+{
+   for(strid_t str = first; str; str = str->next)
+      if(str->type == streamtype_File || str->type == streamtype_File_Uni) {
+         if(str->x.file.behind) {
+            start_write_behind(str);
+            // Buffer and file descriptor are passed to the worker.
+            str->x.file.behind = NULL;
+            str->x.file.buf = (char*)nano_malloc(FILE_BUFFER_SIZE);
+            str->x.file.fd = -1;
+            str->x.file.pos = str->x.file.len = 0;
+            str->x.file.writing = FALSE;
+         } else
+            file_flush(str);
+      }
+
+   nanoglk_stream_wait_written(NULL);
 }
@@ -0,0 +1,578 @@
+/*
+ * This file is part of nanoglk.
+ *
+ * Copyright (C) 2012 by Sebastian Geerken
+ *
+ * Nanoglk is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The text store preserves the contents of a text buffer window, so
+ * that it can be rewrapped when the width of the window changes.
+ *
+ * The content is a sequence of items: words (characters and styles,
+ * together with the style of the space before), images, and line
+ * breaks (from newline characters). Items are stored one after the
+ * other in large blocks ("arena"), which are only allocated and freed
+ * as a whole. Each item caches its width and height, so that line
+ * breaking (see place() and nanoglk_textstore_reflow()) is simple
+ * arithmetic, and nothing is rendered unless it is actually drawn.
+ *
+ * Lines only refer to their first item and the number of items. When
+ * new items are added, only the last line is changed; rewrapping is
+ * one single pass over all items.
+ *
+ * The memory used is limited by nanoglk_scrollback_memory: when this
+ * is exceeded, the oldest block is freed, together with all lines
+ * starting in it. Lines are kept in a ring buffer, so that dropping
+ * them from the beginning is cheap. The preserved lines are also used
+ * for scrolling back (see "wintextbuffer.c").
+ */
+
+#include "nanoglk.h"
+
+#define BLOCK_SIZE 65536
+
+enum { ITEM_WORD, ITEM_IMAGE, ITEM_BREAK };
+
+/*
+ * The header of each item. Followed by "len" characters (Uint16) and
+ * "len" styles (Uint8) for words, or by a pointer to the SDL surface
+ * for images. The size of an item is rounded up to a multiple of
+ * ALIGN, see item_size().
+ */
+struct item
+{
+   Uint8 type;            // ITEM_*
+   Sint8 space_styl;      // style of the space before, or -1
+   Uint16 len;            // number of characters (only ITEM_WORD)
+   Uint16 width, height;  /* size in pixels; for ITEM_BREAK, the height
+                             is used when the line is empty */
+};
+
+#define ALIGN 8
+
+struct block
+{
+   struct block *next;
+   size_t used;
+   Uint8 data[BLOCK_SIZE];
+};
+
+/*
+ * A position of an item. When "offset" is at the end of "block",
+ * the first item of the next block is meant; "block" is NULL before
+ * the first block has been allocated. See item_at().
+ */
+struct pos
+{
+   struct block *block;
+   size_t offset;
+};
+
+struct line
+{
+   struct pos first;      // the first item
+   int num_items;         // the number of items (not including breaks)
+   int x;                 // the width used so far, including spaces
+   int items_height;      // maximum of all item heights; 0 if empty
+   int break_height;      /* if ended by ITEM_BREAK: its height, otherwise
+                             0 */
+};
+
+struct nanoglk_textstore
+{
+   struct block *first_block, *last_block;
+   struct pos start;      /* the first item of the first line; items
+                             before belong to lines already dropped */
+   struct line *lines;    // ring buffer, starting at "first_line"
+   int first_line, num_lines, num_lines_all;
+   size_t bytes;          // memory used by blocks and images
+   int width;             // the width lines are broken at
+   int space_styl;        // see nanoglk_textstore_place()
+};
+
+static size_t item_size(struct item *it);
+static struct item *item_at(struct nanoglk_textstore *ts, struct pos *p);
+static void next_item(struct nanoglk_textstore *ts, struct pos *p);
+static struct item *new_item(struct nanoglk_textstore *ts, size_t size);
+static struct line *line_at(struct nanoglk_textstore *ts, int line);
+static struct line *last_line(struct nanoglk_textstore *ts);
+static struct line *new_line(struct nanoglk_textstore *ts);
+static int place(struct nanoglk_textstore *ts, int w, int space_styl);
+static void append(struct nanoglk_textstore *ts, struct item *it);
+static int in_block(struct nanoglk_textstore *ts, struct pos *p,
+                    struct block *b);
+static void trim(struct nanoglk_textstore *ts);
+static void free_first_block(struct nanoglk_textstore *ts);
+
+/*
+ * Create a new, empty text store; lines are broken at "width" pixels.
+ */
+struct nanoglk_textstore *nanoglk_textstore_new(int width)
+{
+   struct nanoglk_textstore *ts =
+      (struct nanoglk_textstore*)nano_malloc(sizeof(struct nanoglk_textstore));
+   ts->first_block = ts->last_block = NULL;
+   ts->bytes = 0;
+   ts->num_lines_all = 16;
+   ts->lines =
+      (struct line*)nano_malloc(ts->num_lines_all * sizeof(struct line));
+   ts->width = width;
+   nanoglk_textstore_clear(ts);
+   return ts;
+}
+
+void nanoglk_textstore_free(struct nanoglk_textstore *ts)
+{
+   while(ts->first_block)
+      free_first_block(ts);
+   free(ts->lines);
+   free(ts);
+}
+
+/*
+ * Remove all content.
+ */
+void nanoglk_textstore_clear(struct nanoglk_textstore *ts)
+{
+   while(ts->first_block)
+      free_first_block(ts);
+   ts->start.block = NULL;
+   ts->start.offset = 0;
+   ts->first_line = ts->num_lines = 0;
+   ts->space_styl = -1;
+   new_line(ts);
+}
+
+/*
+ * Calculate the width of a word, consisting of parts with different
+ * styles, using only the font metrics; nothing is rendered.
+ */
+int nanoglk_textstore_width_word(const Uint16 *text, const glui32 *styles,
+                                 int len)
+{
+   int w = 0;
+   for(int start = 0, end; start < len; start = end) {
+      for(end = start + 1; end < len && styles[end] == styles[start]; end++)
+         ;
+      w += nano_width16(nanoglk_buffer_font[styles[start]]->metrics,
+                        text + start, end - start);
+   }
+   return w;
+}
+
+/*
+ * Make place for a word or image with the width "w", with a space of
+ * style "space_styl" (or -1) before: the line is broken, when it does
+ * not fit anymore, otherwise the space is added. Return TRUE when a
+ * new line has been begun, and set "*x" to the position, where the
+ * word or image starts. It is then added with nanoglk_textstore_add_word()
+ * or nanoglk_textstore_add_image().
+ *
+ * (The width used for this decision may be larger than the actual one,
+ * as for line input; when rewrapping, the latter is used.)
+ */
+int nanoglk_textstore_place(struct nanoglk_textstore *ts, int w,
+                            int space_styl, int *x)
+{
+   int broken = place(ts, w, space_styl);
+   ts->space_styl = space_styl;
+   *x = last_line(ts)->x;
+   return broken;
+}
+
+/*
+ * Add a word (see nanoglk_textstore_place()). "styles" contains the
+ * styles of all characters.
+ */
+void nanoglk_textstore_add_word(struct nanoglk_textstore *ts,
+                                const Uint16 *text, const glui32 *styles,
+                                int len)
+{
+   struct item *it =
+      new_item(ts, sizeof(struct item) + len * (sizeof(Uint16) + 1));
+   it->type = ITEM_WORD;
+   it->space_styl = ts->space_styl;
+   it->len = len;
+   it->width = nanoglk_textstore_width_word(text, styles, len);
+   it->height = 0;
+
+   Uint16 *c = (Uint16*)(it + 1);
+   Uint8 *s = (Uint8*)(c + len);
+   for(int i = 0; i < len; i++) {
+      c[i] = text[i];
+      s[i] = styles[i];
+      it->height = MAX(it->height, nanoglk_buffer_font[styles[i]]->text_height);
+   }
+
+   append(ts, it);
+   ts->space_styl = -1;
+   trim(ts);
+}
+
+/*
+ * Add an image (see nanoglk_textstore_place()). The text store keeps
+ * a reference, so the caller may free the surface.
+ */
+void nanoglk_textstore_add_image(struct nanoglk_textstore *ts,
+                                 SDL_Surface *image)
+{
+   struct item *it = new_item(ts, sizeof(struct item) + sizeof(SDL_Surface*));
+   it->type = ITEM_IMAGE;
+   it->space_styl = ts->space_styl;
+   it->len = 0;
+   it->width = image->w;
+   it->height = image->h;
+   *(SDL_Surface**)(it + 1) = image;
+   image->refcount++;
+   ts->bytes += image->pitch * image->h;
+
+   append(ts, it);
+   ts->space_styl = -1;
+   trim(ts);
+}
+
+/*
+ * Add a line break. "height" is used as line height when the line
+ * is empty.
+ */
+void nanoglk_textstore_add_break(struct nanoglk_textstore *ts, int height)
+{
+   struct item *it = new_item(ts, sizeof(struct item));
+   it->type = ITEM_BREAK;
+   it->space_styl = -1;
+   it->len = it->width = 0;
+   it->height = height;
+
+   last_line(ts)->break_height = height;
+   new_line(ts);
+   ts->space_styl = -1;
+   trim(ts);
+}
+
+/*
+ * Break all lines again at "width" pixels. This is done in one pass
+ * over all items, using the cached sizes.
+ */
+void nanoglk_textstore_reflow(struct nanoglk_textstore *ts, int width)
+{
+   ts->width = width;
+   ts->num_lines = 0;
+   new_line(ts);
+
+   struct pos p = ts->start;
+   line_at(ts, 0)->first = p;
+
+   struct item *it;
+   while((it = item_at(ts, &p))) {
+      if(it->type == ITEM_BREAK) {
+         last_line(ts)->break_height = it->height;
+         next_item(ts, &p);
+         new_line(ts)->first = p;
+      } else {
+         if(place(ts, it->width, it->space_styl))
+            last_line(ts)->first = p;
+         append(ts, it);
+         next_item(ts, &p);
+      }
+   }
+
+   ts->space_styl = -1;
+}
+
+/*
+ * Return the number of lines (the lines dropped because of the memory
+ * limit are not counted; so the numbers of the remaining lines change
+ * in this case). The last line is the one new items are added to; it
+ * is empty after a line break.
+ */
+int nanoglk_textstore_num_lines(struct nanoglk_textstore *ts)
+{
+   return ts->num_lines;
+}
+
+/*
+ * Return the height of a line: the maximal height of all items, or,
+ * for an empty line, the height passed to nanoglk_textstore_add_break();
+ * 0 for the empty last line.
+ */
+int nanoglk_textstore_line_height(struct nanoglk_textstore *ts, int line)
+{
+   struct line *l = line_at(ts, line);
+   return l->num_items > 0 ? l->items_height : l->break_height;
+}
+
+/*
+ * Return the width used by a line.
+ */
+int nanoglk_textstore_line_width(struct nanoglk_textstore *ts, int line)
+{
+   return line_at(ts, line)->x;
+}
+
+/*
+ * Draw a line into a window, at the vertical position "y" (relative
+ * to the window area, may be negative). Drawing is clipped to the
+ * window area. The space between the items is not drawn, the caller
+ * should clear the line before.
+ */
+void nanoglk_textstore_draw_line(struct nanoglk_textstore *ts, int line,
+                                 winid_t win, int y)
+{
+   SDL_Rect old_clip;
+   SDL_GetClipRect(nanoglk_surface, &old_clip);
+   SDL_SetClipRect(nanoglk_surface, &win->area);
+
+   struct line *l = line_at(ts, line);
+   struct pos p = l->first;
+   int x = 0;
+   for(int i = 0; i < l->num_items; i++, next_item(ts, &p)) {
+      struct item *it = item_at(ts, &p);
+      if(x != 0 && it->space_styl != -1)
+         x += nanoglk_buffer_font[it->space_styl]->space_width;
+
+      if(it->type == ITEM_IMAGE) {
+         SDL_Surface *image = *(SDL_Surface**)(it + 1);
+         SDL_Rect r = { win->area.x + x, win->area.y + y, image->w, image->h };
+         SDL_BlitSurface(image, NULL, nanoglk_surface, &r);
+      } else {
+         Uint16 *c = (Uint16*)(it + 1);
+         Uint8 *s = (Uint8*)(c + it->len);
+         int xp = x;
+         for(int start = 0, end; start < it->len; start = end) {
+            for(end = start + 1; end < it->len && s[end] == s[start]; end++)
+               ;
+            // Put together from cached glyphs, see "misc/glyph.c".
+            SDL_Surface *t = nano_render16(nanoglk_buffer_font[s[start]]->metrics,
+                                           c + start, end - start,
+                                           win->fg[s[start]], win->bg[s[start]]);
+            SDL_Rect r = { win->area.x + xp, win->area.y + y, t->w, t->h };
+            SDL_BlitSurface(t, NULL, nanoglk_surface, &r);
+            xp += t->w;
+            SDL_FreeSurface(t);
+         }
+      }
+
+      x += it->width;
+   }
+
+   SDL_SetClipRect(nanoglk_surface, &old_clip);
+}
+
+size_t item_size(struct item *it)
+{
+   size_t size = sizeof(struct item);
+   switch(it->type) {
+   case ITEM_WORD:
+      size += it->len * (sizeof(Uint16) + 1);
+      break;
+
+   case ITEM_IMAGE:
+      size += sizeof(SDL_Surface*);
+      break;
+   }
+
+   return (size + ALIGN - 1) & ~(ALIGN - 1);
+}
+
+/*
+ * Return the item at a position (or NULL at the end), after
+ * normalizing the position (see definition of struct pos).
+ */
+struct item *item_at(struct nanoglk_textstore *ts, struct pos *p)
+{
+   if(p->block == NULL) {
+      if(ts->first_block == NULL)
+         return NULL;
+      p->block = ts->first_block;
+      p->offset = 0;
+   }
+
+   while(p->offset >= p->block->used) {
+      if(p->block->next == NULL)
+         return NULL;
+      p->block = p->block->next;
+      p->offset = 0;
+   }
+
+   return (struct item*)(p->block->data + p->offset);
+}
+
+void next_item(struct nanoglk_textstore *ts, struct pos *p)
+{
+   struct item *it = item_at(ts, p);
+   if(it)
+      p->offset += item_size(it);
+}
+
+/*
+ * Allocate space for a new item at the end, with a size of "size"
+ * bytes (not yet rounded up).
+ */
+struct item *new_item(struct nanoglk_textstore *ts, size_t size)
+{
+   size = (size + ALIGN - 1) & ~(ALIGN - 1);
+   nano_failunless(size <= BLOCK_SIZE, "item too large (%d bytes)", (int)size);
+
+   if(ts->last_block == NULL || ts->last_block->used + size > BLOCK_SIZE) {
+      struct block *b = (struct block*)nano_malloc(sizeof(struct block));
+      b->next = NULL;
+      b->used = 0;
+      if(ts->last_block)
+         ts->last_block->next = b;
+      else {
+         // Positions before the first block refer to this one now.
+         ts->first_block = b;
+         ts->start.block = b;
+         for(int i = 0; i < ts->num_lines; i++)
+            if(line_at(ts, i)->first.block == NULL)
+               line_at(ts, i)->first.block = b;
+      }
+      ts->last_block = b;
+      ts->bytes += sizeof(struct block);
+   }
+
+   struct item *it = (struct item*)(ts->last_block->data + ts->last_block->used);
+   ts->last_block->used += size;
+   return it;
+}
+
+struct line *line_at(struct nanoglk_textstore *ts, int line)
+{
+   return &ts->lines[(ts->first_line + line) % ts->num_lines_all];
+}
+
+struct line *last_line(struct nanoglk_textstore *ts)
+{
+   return line_at(ts, ts->num_lines - 1);
+}
+
+/*
+ * Begin a new, empty line, starting at the end of the items.
+ */
+struct line *new_line(struct nanoglk_textstore *ts)
+{
+   if(ts->num_lines >= ts->num_lines_all) {
+      // Ring buffer is full: copy into a larger one, starting at 0.
+      struct line *lines =
+         (struct line*)nano_malloc(2 * ts->num_lines_all * sizeof(struct line));
+      for(int i = 0; i < ts->num_lines; i++)
+         lines[i] = *line_at(ts, i);
+      free(ts->lines);
+      ts->lines = lines;
+      ts->first_line = 0;
+      ts->num_lines_all <<= 1;
+   }
+
+   ts->num_lines++;
+   struct line *l = last_line(ts);
+   l->first.block = ts->last_block;
+   l->first.offset = ts->last_block ? ts->last_block->used : 0;
+   l->num_items = l->x = l->items_height = l->break_height = 0;
+   return l;
+}
+
+/*
+ * Line breaking: if an item of width "w" (with a space of style
+ * "space_styl" before) does not fit into the last line, begin a new
+ * one and return TRUE; otherwise add the space.
+ */
+int place(struct nanoglk_textstore *ts, int w, int space_styl)
+{
+   struct line *l = last_line(ts);
+   int w_space =
+      space_styl != -1 ? nanoglk_buffer_font[space_styl]->space_width : 0;
+
+   if(l->x != 0 && l->x + w_space + w > ts->width) {
+      new_line(ts);
+      return TRUE;
+   } else {
+      if(l->x != 0)
+         l->x += w_space;
+      return FALSE;
+   }
+}
+
+/*
+ * Add an item to the last line.
+ */
+void append(struct nanoglk_textstore *ts, struct item *it)
+{
+   struct line *l = last_line(ts);
+   l->x += it->width;
+   l->items_height = MAX(l->items_height, it->height);
+   l->num_items++;
+}
+
+/*
+ * Test whether a position refers to an item in block "b".
+ */
+int in_block(struct nanoglk_textstore *ts, struct pos *p, struct block *b)
+{
+   struct pos q = *p;
+   item_at(ts, &q);
+   return q.block == b;
+}
+
+/*
+ * Free the oldest blocks (and the lines starting in them), as long as
+ * more memory than nanoglk_scrollback_memory is used. The block
+ * containing the beginning of the last line is never freed.
+ */
+void trim(struct nanoglk_textstore *ts)
+{
+   while(ts->bytes + ts->num_lines_all * sizeof(struct line)
+         > nanoglk_scrollback_memory &&
+         ts->first_block != ts->last_block &&
+         !in_block(ts, &last_line(ts)->first, ts->first_block)) {
+      struct block *b = ts->first_block;
+      while(in_block(ts, &line_at(ts, 0)->first, b)) {
+         ts->first_line = (ts->first_line + 1) % ts->num_lines_all;
+         ts->num_lines--;
+      }
+
+      // Remaining lines may still refer to the end of the block.
+      for(int i = 0; i < ts->num_lines && line_at(ts, i)->first.block == b;
+          i++) {
+         line_at(ts, i)->first.block = b->next;
+         line_at(ts, i)->first.offset = 0;
+      }
+
+      free_first_block(ts);
+      ts->start = line_at(ts, 0)->first;
+   }
+}
+
+void free_first_block(struct nanoglk_textstore *ts)
+{
+   struct block *b = ts->first_block;
+
+   // Release the references on images.
+   for(size_t offset = 0; offset < b->used; ) {
+      struct item *it = (struct item*)(b->data + offset);
+      if(it->type == ITEM_IMAGE) {
+         SDL_Surface *image = *(SDL_Surface**)(it + 1);
+         ts->bytes -= image->pitch * image->h;
+         SDL_FreeSurface(image);
+      }
+      offset += item_size(it);
+   }
+
+   ts->first_block = b->next;
+   if(ts->first_block == NULL)
+      ts->last_block = NULL;
+   ts->bytes -= sizeof(struct block);
+   free(b);
+}
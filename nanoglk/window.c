@@ -63,6 +63,7 @@ static void window_rearrange(winid_t pair);
 static void window_draw_border(winid_t pair);
 static void window_resize(winid_t win, SDL_Rect *area);
 static void flush(winid_t win);
+static void unset_echo(winid_t win, strid_t str);
 static glui32 get_line16(winid_t win, Uint16 *text, int max_len, int max_char);
 
 // See comment at the beginning of this file for more informations.
@@ -177,6 +178,7 @@ winid_t glk_window_open(winid_t split, glui32 method, glui32 size,
 
    win->stream = nanoglk_stream_new(streamtype_Window, 0);
    win->stream->x.window = win;
+   win->echo = NULL;
 
    win->method = method;
    win->size = size;
@@ -226,6 +228,7 @@ winid_t glk_window_open(winid_t split, glui32 method, glui32 size,
       // comment on these members in "nanoglk.h".)
       pair = (winid_t)nano_malloc(sizeof(struct glk_window_struct));
       pair->stream = NULL;
+      pair->echo = NULL;
       pair->wintype = wintype_Pair;
       pair->rock = 0;
       pair->left = split;
@@ -465,6 +468,11 @@ static void window_destroy(winid_t win)
 {
    nanoglk_call_unregi_obj(win, gidisp_Class_Window, win->disprock);
 
+   // The window has already been removed from the tree, so this affects
+   // only the remaining windows.
+   if(win->stream)
+      nanoglk_window_unset_echo(win->stream);
+
    switch(win->wintype) {
    case wintype_TextBuffer:
       nanoglk_wintextbuffer_free(win);
@@ -600,6 +608,10 @@ void window_rearrange(winid_t pair)
    }
 
    window_draw_border(pair);
+
+   // All windows have been redrawn.
+   if(pair == root)
+      nano_damage_all();
 }
 
 /*
@@ -797,17 +809,46 @@ strid_t glk_window_get_stream(winid_t win)
    return win->stream;
 }
 
+/*
+ * Everything written into the window stream is also written into the
+ * echo stream; see put_char_uni() and others in "stream.c". Input lines
+ * are echoed by nanoglk_stream_echo_line().
+ */
 void glk_window_set_echo_stream(winid_t win, strid_t str)
 {
    nanoglk_log("glk_set_echo_stream(%p, %p)", win, str);
-   nano_fail("glk_window_set_echo_stream not implemented");
+
+   if(str && str == win->stream)
+      nano_warn("window %p cannot echo into itself", win);
+   else
+      win->echo = str;
 }
 
 strid_t glk_window_get_echo_stream(winid_t win)
 {
-   nanoglk_log("glk_get_echo_stream(%p) => ...", win);
-   nano_fail("glk_window_get_echo_stream not implemented");
-   return NULL;
+   nanoglk_log("glk_get_echo_stream(%p) => %p", win, win->echo);
+   return win->echo;
+}
+
+/*
+ * Remove a stream, which is closed, as echo stream from all windows.
+ * Called by glk_stream_close().
+ */
+void nanoglk_window_unset_echo(strid_t str)
+{
+   if(root)
+      unset_echo(root, str);
+}
+
+void unset_echo(winid_t win, strid_t str)
+{
+   if(win->echo == str)
+      win->echo = NULL;
+
+   if(win->left)
+      unset_echo(win->left, str);
+   if(win->right)
+      unset_echo(win->right, str);
 }
 
 void glk_set_window(winid_t win)
@@ -833,6 +874,43 @@ void nanoglk_window_put_char(winid_t win, glui32 c)
    }
 }
 
+/*
+ * Put a Latin-1 buffer into the window. Called by several stream
+ * functions. Text buffer windows process the buffer as a whole.
+ */
+void nanoglk_window_put_buffer(winid_t win, const unsigned char *buf,
+                               glui32 len)
+{
+   switch(win->wintype) {
+   case wintype_TextBuffer:
+      nanoglk_wintextbuffer_put_buffer(win, buf, len);
+      break;
+
+   case wintype_TextGrid:
+      for(glui32 i = 0; i < len; i++)
+         nanoglk_wintextgrid_put_char(win, buf[i]);
+      break;
+   }
+}
+
+/*
+ * Put a Unicode buffer into the window. See nanoglk_window_put_buffer().
+ */
+void nanoglk_window_put_buffer_uni(winid_t win, const glui32 *buf,
+                                   glui32 len)
+{
+   switch(win->wintype) {
+   case wintype_TextBuffer:
+      nanoglk_wintextbuffer_put_buffer_uni(win, buf, len);
+      break;
+
+   case wintype_TextGrid:
+      for(glui32 i = 0; i < len; i++)
+         nanoglk_wintextgrid_put_char(win, buf[i]);
+      break;
+   }
+}
+
 /*
  * Flush all windows, i. e. display any pending output on the
  * screen. Called by glk_select().
@@ -843,7 +921,7 @@ void nanoglk_window_flush_all(void)
 
    if(root)
       flush(root);
-   SDL_Flip(nanoglk_surface);
+   nano_update(nanoglk_surface);
 }
 
 /*
@@ -961,7 +1039,7 @@ glui32 nanoglk_window_get_line(winid_t win, char *buf, glui32 maxlen,
               win, buf, maxlen, initlen);
 
    // Convert char* to Uint16* ...
-   Uint16 *text = (Uint16*)nano_malloc((maxlen + 1) * sizeof(Uint16*));
+   Uint16 *text = (Uint16*)nano_malloc((maxlen + 1) * sizeof(Uint16));
    int i;
    for(i = 0; i < initlen; i++)
       text[i] = buf[i];
@@ -974,6 +1052,8 @@ glui32 nanoglk_window_get_line(winid_t win, char *buf, glui32 maxlen,
    for(i = 0; text[i]; i++)
       buf[i] = text[i];
    
+   free(text);
+   nanoglk_stream_echo_line(win, buf, FALSE, len);
    return len;
 }
 
@@ -994,7 +1074,7 @@ glui32 nanoglk_window_get_line_uni(winid_t win, glui32 *buf, glui32 maxlen,
               win, buf, maxlen, initlen);
 
    // Convert glui32* to Uint16* ...
-   Uint16 *text = (Uint16*)nano_malloc((maxlen + 1) * sizeof(Uint16*));
+   Uint16 *text = (Uint16*)nano_malloc((maxlen + 1) * sizeof(Uint16));
    int i;
    for(i = 0; i < initlen; i++)
       text[i] = buf[i];
@@ -1007,6 +1087,8 @@ glui32 nanoglk_window_get_line_uni(winid_t win, glui32 *buf, glui32 maxlen,
    for(i = 0; text[i]; i++)
       buf[i] = text[i];
   
+   free(text);
+   nanoglk_stream_echo_line(win, buf, TRUE, len);
    return len;
 }
 
@@ -59,6 +59,7 @@ void nanoglk_wingraphics_clear(winid_t win)
    struct graphics *g = (struct graphics*)win->data;
    SDL_FillRect(nanoglk_surface, &win->area,
                 SDL_MapRGB(nanoglk_surface->format, g->bg.r, g->bg.g, g->bg.b));
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
 }
 
 /*
@@ -125,4 +126,5 @@ void nanoglk_wingraphics_put_image(winid_t win, SDL_Surface *image,
                    MIN(image->h, win->area.h - val2) };
    SDL_Rect r2 = { win->area.x + val1, win->area.y + val2, r1.w, r1.h };
    SDL_BlitSurface(image, &r1, nanoglk_surface, &r2);
+   nano_damage(r2.x, r2.y, r1.w, r1.h);
 }
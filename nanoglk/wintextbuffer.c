@@ -21,15 +21,21 @@
  * Handling text buffer windows. Most functions are called from the
  * general window functions defined in "window.c".
  *
- * TODO (aside from several glitches): perhaps preservation of
- * text. This would make other features possible: e. g. proper
- * resizing and scrolling.
+ * Text is drawn immediately, but also preserved in a text store (see
+ * "textstore.c"), which also does the line breaking. When the window
+ * width changes, the text is rewrapped and the visible part redrawn.
+ *
+ * Scrolling is deferred: when a new line does not fit anymore, the
+ * amount is only summed up, and the following text is not drawn. On
+ * the next flush (or before a "- more -" prompt), the window is
+ * scrolled once by the total amount, and only the new lines are drawn
+ * from the text store (see update()).
  */
 
 #include "nanoglk.h"
 
 #define MAX_WORD_LEN 2000
-#define MAX_HISTORY  100
+#define MAX_PATTERN  100
 
 /*
  * The structure used for win->data.
@@ -53,41 +59,71 @@ struct textbuffer
                              wait for a key). */
 
    // The following three variables contain the word to be rendered.
-   Uint16 curword[MAX_WORD_LEN + 1];    /* The characters. See
-                                           render_word(), why one more
-                                           character is needed (for
-                                           the 0-termination). */
+   Uint16 curword[MAX_WORD_LEN];        // The characters.
    glui32 curword_styles[MAX_WORD_LEN]; // style_*, as defined in "glk.h"
    int curword_len;                     // the number of chacters.
 
    glui32 space_styl; /* The style (style_*, as defined in "glk.h")
                          of the space before the current word. -1 when
                          there is no space. */
+
+   struct nanoglk_textstore *store; // the preserved text, see "textstore.c"
+
+   int scroll;            /* The number of pixels the window still has to
+                             be scrolled, see update(). */
+   int pending_lines;     /* The number of lines (at the end of the text
+                             store) not yet drawn; as long as this is
+                             not 0, text is not drawn immediately. */
 };
 
-static void add_word(winid_t win, SDL_Surface **word);
-static SDL_Surface **render_word(winid_t win);
-static int width_word(SDL_Surface **t);
-static void free_word(SDL_Surface **t);
+static void end_word(winid_t win);
+static void add_word(winid_t win);
+static void add_image(winid_t win, SDL_Surface *image);
+static void place(winid_t win, int w);
+static void blit(winid_t win, SDL_Surface *s);
+static void advance(winid_t win, int w, int h);
+static void update(winid_t win);
+static int part_end(winid_t win, int start);
+static void redraw(winid_t win);
+static void add_input(winid_t win, Uint16 *text);
+static void draw_lines(winid_t win, int y_last);
+static void scrollback(winid_t win);
+static void put_space(winid_t win);
+static void put_newline(winid_t win);
+static glui32 word_len(const unsigned char *buf, glui32 len);
 static void new_line(winid_t win);
 static void ensure_space(winid_t win, int space);
 static void wait_for_key(void);
 static void user_has_read(winid_t win);
 
 /*
- * The input history. TODO Should be either window specific or global,
- * and so also used for grid buffers, as soon as these are implemented
- * fully.
+ * A line of the input history, which has been changed during line
+ * input; see nanoglk_wintextbuffer_get_line16().
  */
-static int num_history = 0;
-static Uint16* history[MAX_HISTORY];
+struct repl
+{
+   int pos;
+   Uint16 *text;
+   struct repl *next;
+};
+
+static const Uint16 *history_line(struct repl *repl, int pos);
+static void set_repl(struct repl **repl, int pos, const Uint16 *text);
+static void free_repl(struct repl *repl);
+static void copy_line(Uint16 *text, const Uint16 *src, int max_len);
+static void search_history(winid_t win, Uint16 *text, int max_len);
+static void draw_search(winid_t win, const Uint16 *pattern,
+                        const Uint16 *line);
 
 /*
  * Initialize a text buffer window.
  */
 void nanoglk_wintextbuffer_init(winid_t win)
 {
-   win->data = nano_malloc(sizeof(struct textbuffer));
+   struct textbuffer *tb =
+      (struct textbuffer*)nano_malloc(sizeof(struct textbuffer));
+   tb->store = nanoglk_textstore_new(win->area.w);
+   win->data = tb;
    nanoglk_wintextbuffer_clear(win);
 }
 
@@ -98,13 +134,15 @@ void nanoglk_wintextbuffer_clear(winid_t win)
 {
    struct textbuffer *tb = (struct textbuffer*)win->data;
    tb->cur_x = tb->cur_y = tb->line_height = tb->last_line_height
-      = tb->curword_len = tb->read_until = 0;
+      = tb->curword_len = tb->read_until = tb->scroll = tb->pending_lines = 0;
    tb->space_styl = -1;
+   nanoglk_textstore_clear(tb->store);
    nano_trace("win %p (clear): space_styl = %d", win, tb->space_styl);
    SDL_FillRect(nanoglk_surface, &win->area,
                 SDL_MapRGB(nanoglk_surface->format,
                            win->bg[win->cur_styl].r, win->bg[win->cur_styl].g,
                            win->bg[win->cur_styl].b));
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
 }
 
 /*
@@ -112,7 +150,9 @@ void nanoglk_wintextbuffer_clear(winid_t win)
  */
 void nanoglk_wintextbuffer_free(winid_t win)
 {
-   free(win->data);
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   nanoglk_textstore_free(tb->store);
+   free(tb);
 }
 
 /*
@@ -126,13 +166,16 @@ void nanoglk_wintextbuffer_resize(winid_t win, SDL_Rect *area)
               area->x, area->y, area->w, area->h);
 
    if(area->w != win->area.w) {
-      // Width has changed. Since the text is not preserved, it cannot be
-      // rewrapped, so the window is simply cleared (in the hope that this
-      // does not happen very often).
+      // Width has changed: rewrap the preserved text, and draw the last
+      // lines again.
+      struct textbuffer *tb = (struct textbuffer*)win->data;
       win->area = *area;
-      nanoglk_wintextbuffer_clear(win);
+      nanoglk_textstore_reflow(tb->store, area->w);
+      redraw(win);
    } else {
       nano_trace("   same width");
+      // The content on the screen is copied, so it has to be complete.
+      update(win);
       if(area->h == win->area.h) {
          // Window size has not changed at all. Simply copy.
          nano_trace("      same height");
@@ -173,6 +216,7 @@ void nanoglk_wintextbuffer_resize(winid_t win, SDL_Rect *area)
       }
 
       win->area = *area;
+      nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
    }
 
    nano_trace("finished: nanoglk_wintextbuffer_resize(...)");
@@ -182,56 +226,189 @@ void nanoglk_wintextbuffer_resize(winid_t win, SDL_Rect *area)
  * Flush a text buffer window, i. e. display all pending output.
  */
 void nanoglk_wintextbuffer_flush(winid_t win)
+{
+   end_word(win);
+   update(win);
+}
+
+/*
+ * Add the current word, if there is one.
+ */
+void end_word(winid_t win)
 {
    struct textbuffer *tb = (struct textbuffer*)win->data;
    
    // TODO In some cases, a part of an unfinished word is broken here. Check
    // again.
 
-   if(tb->curword_len > 0) {
-      SDL_Surface **t = render_word(win);
-      add_word(win, t);
-      free_word(t);
-   }
+   if(tb->curword_len > 0)
+      add_word(win);
 
    tb->curword_len = 0;
 }
 
 /*
- * Add a rendered word, i. e. an array of SDL surfaces. Typically text
- * (as returned by render_word()), but "word" may also contain images.
+ * Add the current word. It is first measured (only using the font
+ * metrics) to determine its position, and then the parts (with different styles)
+ * are rendered and copied on the screen surface.
+ */
+void add_word(winid_t win)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   place(win, nanoglk_textstore_width_word(tb->curword, tb->curword_styles,
+                                           tb->curword_len));
+
+   // Make space for the whole word at once: a "- more -" prompt in
+   // the middle of the word would let update() redraw the current line
+   // from the text store, which does not yet contain the parts already
+   // drawn (or advanced).
+   int h = 0;
+   for(int start = 0, end; start < tb->curword_len; start = end) {
+      end = part_end(win, start);
+      h = MAX(h, nanoglk_buffer_font[tb->curword_styles[start]]->text_height);
+   }
+   ensure_space(win, h);
+
+   for(int start = 0, end; start < tb->curword_len; start = end) {
+      end = part_end(win, start);
+
+      int styl = tb->curword_styles[start];
+      struct nano_metrics *m = nanoglk_buffer_font[styl]->metrics;
+      if(tb->pending_lines > 0)
+         // Drawn later by update(); only the size is needed now (the
+         // same as of the surface returned by nano_render16()).
+         advance(win, MAX(nano_width16(m, tb->curword + start, end - start), 1),
+                 m->height);
+      else {
+         // Put together from cached glyphs, see "misc/glyph.c".
+         SDL_Surface *t = nano_render16(m, tb->curword + start, end - start,
+                                        win->fg[styl], win->bg[styl]);
+         blit(win, t);
+         SDL_FreeSurface(t);
+      }
+   }
+
+   nanoglk_textstore_add_word(tb->store, tb->curword, tb->curword_styles,
+                              tb->curword_len);
+}
+
+/*
+ * Add an image into the text flow.
  */
-void add_word(winid_t win, SDL_Surface **word)
+void add_image(winid_t win, SDL_Surface *image)
 {
    struct textbuffer *tb = (struct textbuffer*)win->data;
 
-   int w_space =
-      tb->space_styl != -1 ?
-      nanoglk_buffer_font[tb->space_styl]->space_width : 0;
-   nano_trace("win %p (add word): space width = %d", win, w_space);
-   int w_word = width_word(word);
-   if(tb->cur_x != 0 && tb->cur_x + w_space + w_word > win->area.w)
+   place(win, image->w);
+   ensure_space(win, image->h);
+   if(tb->pending_lines > 0)
+      advance(win, image->w, image->h); // drawn later by update()
+   else
+      blit(win, image);
+   nanoglk_textstore_add_image(tb->store, image);
+}
+
+/*
+ * Make place for a word (or an image, or the line input) with the
+ * width "w": break the line, when it does not fit anymore, otherwise
+ * add the pending space. The decision is made by the text store.
+ */
+void place(winid_t win, int w)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   int x;
+   if(nanoglk_textstore_place(tb->store, w, tb->space_styl, &x))
       // word does not fit -> break line
       new_line(win);
-   else if(tb->cur_x != 0)
-      // word fits -> only add space before
-      tb->cur_x += w_space;
-   
-   int i;
-   for(i = 0; word[i]; i++) {
-      // Simply copy on screen surface.
+   tb->cur_x = x;
+   nano_trace("win %p (place): x = %d", win, tb->cur_x);
+}
 
-      // TODO Notice that all characters are aligned at the top (rendered at
-      // the same vertical position), not at the base line.
-      ensure_space(win, word[i]->h);
-      
-      SDL_Rect rt = { 0,  0, word[i]->w, word[i]->h };
-      SDL_Rect rs = { win->area.x + tb->cur_x, win->area.y + tb->cur_y,
-                      word[i]->w, word[i]->h };
-      SDL_BlitSurface(word[i], &rt, nanoglk_surface, &rs);
-      tb->cur_x += word[i]->w;
-      tb->line_height = MAX(tb->line_height, word[i]->h);
+/*
+ * Simply copy a surface on the screen surface, at the current
+ * position, which is then advanced.
+ *
+ * TODO Notice that all characters are aligned at the top (rendered at
+ * the same vertical position), not at the base line.
+ */
+void blit(winid_t win, SDL_Surface *s)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   SDL_Rect rt = { 0,  0, s->w, s->h };
+   SDL_Rect rs = { win->area.x + tb->cur_x, win->area.y + tb->cur_y,
+                   s->w, s->h };
+   SDL_BlitSurface(s, &rt, nanoglk_surface, &rs);
+   nano_damage(rs.x, rs.y, rs.w, rs.h);
+   advance(win, s->w, s->h);
+}
+
+/*
+ * Advance the current position by something of the size "w" x "h",
+ * without drawing it.
+ */
+void advance(winid_t win, int w, int h)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   tb->cur_x += w;
+   tb->line_height = MAX(tb->line_height, h);
+}
+
+/*
+ * Bring the window on the screen up to date: scroll it by the amount
+ * summed up by ensure_space(), and draw the lines which have not been
+ * drawn yet, from the text store. The part above these lines is only
+ * copied; when the window has been scrolled by its height or more,
+ * nothing is copied at all.
+ */
+void update(winid_t win)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   struct nanoglk_textstore *ts = tb->store;
+
+   if(tb->pending_lines == 0)
+      return;
+
+   // Search backwards the first line to draw; lines above the window
+   // are not regarded. (Lines may have been dropped from the text
+   // store in the meantime, see "textstore.c".)
+   int last = nanoglk_textstore_num_lines(ts) - 1;
+   int first = last, y_first = tb->cur_y;
+   while(first > 0 && first > last - tb->pending_lines + 1 && y_first > 0) {
+      first--;
+      y_first -= nanoglk_textstore_line_height(ts, first);
+   }
+
+   // Scroll the part above (if still visible), and clear the rest.
+   int y_clear = 0;
+   if(y_first > 0 && y_first + tb->scroll <= win->area.h) {
+      SDL_Rect r1 = { win->area.x, win->area.y + tb->scroll,
+                      win->area.w, y_first };
+      SDL_Rect r2 = { win->area.x, win->area.y, win->area.w, y_first };
+      SDL_BlitSurface(nanoglk_surface, &r1, nanoglk_surface, &r2);
+      y_clear = y_first;
    }
+
+   SDL_Rect r = { win->area.x, win->area.y + y_clear,
+                  win->area.w, win->area.h - y_clear };
+   SDL_FillRect(nanoglk_surface, &r,
+                SDL_MapRGB(nanoglk_surface->format,
+                           win->bg[win->cur_styl].r,
+                           win->bg[win->cur_styl].g,
+                           win->bg[win->cur_styl].b));
+
+   for(int i = first, y = y_first; i <= last && y < win->area.h;
+       y += nanoglk_textstore_line_height(ts, i), i++)
+      if(y + nanoglk_textstore_line_height(ts, i) > 0)
+         nanoglk_textstore_draw_line(ts, i, win, y);
+
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
+
+   nano_trace("win %p (update): scrolled by %d, %d lines drawn",
+              win, tb->scroll, last - first + 1);
+   tb->scroll = tb->pending_lines = 0;
 }
 
 /*
@@ -251,21 +428,11 @@ void nanoglk_wintextbuffer_put_char(winid_t win, glui32 c)
 
    switch(c) {
    case ' ':
-      // End of word, but space has to be preserved.
-      nanoglk_wintextbuffer_flush(win); /* Note: At this point,
-                                           tb->space_styl refers to
-                                           the space *before* the word
-                                           which is going to be displayed. */
-      tb->space_styl = win->cur_styl;   /* And now, it refers to the
-                                           space *after* this word
-                                           (which was just displayed). */
-      nano_trace("win %p (add space): space_styl = %d", win, tb->space_styl);
+      put_space(win);
       break;
 
    case '\n':
-      // End of line, so end of word.
-      nanoglk_wintextbuffer_flush(win);
-      new_line(win);
+      put_newline(win);
       break;
       
    default:
@@ -279,6 +446,128 @@ void nanoglk_wintextbuffer_put_char(winid_t win, glui32 c)
    }
 }
 
+/*
+ * Puts a Latin-1 buffer into a text buffer window; equivalent to
+ * calling nanoglk_wintextbuffer_put_char() for each character, but
+ * the buffer is split into words in one pass, and the characters of a
+ * word are copied at once.
+ */
+void nanoglk_wintextbuffer_put_buffer(winid_t win, const unsigned char *buf,
+                                      glui32 len)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   nano_trace("nanoglk_wintextbuffer_put_buffer(%p, ..., %d) at (%d, %d)",
+              win, len, tb->cur_x, tb->cur_y);
+
+   for(glui32 i = 0; i < len; ) {
+      glui32 n = word_len(buf + i, len - i);
+      int m = MIN(n, (glui32)(MAX_WORD_LEN - tb->curword_len));
+      for(int j = 0; j < m; j++) {
+         tb->curword[tb->curword_len + j] = buf[i + j];
+         tb->curword_styles[tb->curword_len + j] = win->cur_styl;
+      }
+      tb->curword_len += m;
+      i += n;
+
+      if(i < len) {
+         if(buf[i] == ' ')
+            put_space(win);
+         else
+            put_newline(win);
+         i++;
+      }
+   }
+}
+
+/*
+ * Like nanoglk_wintextbuffer_put_buffer(), but for Unicode.
+ */
+void nanoglk_wintextbuffer_put_buffer_uni(winid_t win, const glui32 *buf,
+                                          glui32 len)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   nano_trace("nanoglk_wintextbuffer_put_buffer_uni(%p, ..., %d) at (%d, %d)",
+              win, len, tb->cur_x, tb->cur_y);
+
+   for(glui32 i = 0; i < len; ) {
+      glui32 n = 0;
+      while(i + n < len && buf[i + n] != ' ' && buf[i + n] != '\n')
+         n++;
+
+      int m = MIN(n, (glui32)(MAX_WORD_LEN - tb->curword_len));
+      for(int j = 0; j < m; j++) {
+         tb->curword[tb->curword_len + j] = buf[i + j];
+         tb->curword_styles[tb->curword_len + j] = win->cur_styl;
+      }
+      tb->curword_len += m;
+      i += n;
+
+      if(i < len) {
+         if(buf[i] == ' ')
+            put_space(win);
+         else
+            put_newline(win);
+         i++;
+      }
+   }
+}
+
+/*
+ * End of word, but space has to be preserved.
+ */
+void put_space(winid_t win)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   end_word(win);                    /* Note: At this point,
+                                        tb->space_styl refers to
+                                        the space *before* the word
+                                        which is going to be displayed. */
+   tb->space_styl = win->cur_styl;   /* And now, it refers to the
+                                        space *after* this word
+                                        (which was just displayed). */
+   nano_trace("win %p (add space): space_styl = %d", win, tb->space_styl);
+}
+
+/*
+ * End of line, so end of word.
+ */
+void put_newline(winid_t win)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   end_word(win);
+   nanoglk_textstore_add_break(tb->store,
+                               nanoglk_buffer_font[win->cur_styl]->text_height);
+   new_line(win);
+}
+
+/*
+ * Return the number of characters before the first space or newline
+ * (or "len", if there is none). Eight characters are tested at once,
+ * as long as possible.
+ */
+glui32 word_len(const unsigned char *buf, glui32 len)
+{
+   // A byte in "x" is zero, iff "(x - ONES) & ~x & HIGHS" is not zero.
+   const Uint64 ones = 0x0101010101010101ULL, highs = ones * 0x80;
+   const Uint64 spaces = ones * ' ', newlines = ones * '\n';
+
+   glui32 i = 0;
+   for(; i + 8 <= len; i += 8) {
+      Uint64 x, s, n;
+      memcpy(&x, buf + i, 8);
+      s = x ^ spaces;
+      n = x ^ newlines;
+      if(((s - ones) & ~s & highs) || ((n - ones) & ~n & highs))
+         break;
+   }
+
+   while(i < len && buf[i] != ' ' && buf[i] != '\n')
+      i++;
+   return i;
+}
+
 /*
  * Put an image into a text buffer window. (The complicated stuff is
  * done in "image.c".
@@ -286,11 +575,10 @@ void nanoglk_wintextbuffer_put_char(winid_t win, glui32 c)
 void nanoglk_wintextbuffer_put_image(winid_t win, SDL_Surface *image,
                                      glsi32 val1, glsi32 val2)
 {
-   nanoglk_wintextbuffer_flush(win);
+   end_word(win);
 
    // TODO Currently no alignment etc., just inserstion into the text flow.
-   SDL_Surface *word[2] = { image, NULL };
-   add_word(win, word);
+   add_image(win, image);
 }
 
 /*
@@ -324,34 +612,14 @@ glui32 nanoglk_wintextbuffer_get_line16(winid_t win, Uint16 *text,
                                         glk_select(), but we do not want to
                                         rely on this. */
 
-   // Show the pending space and ensure a minimal width for the input.
-   int w_space =
-      tb->space_styl != -1 ?
-      nanoglk_buffer_font[tb->space_styl]->space_width : 0;
-   nano_trace("win %p (get line): space width = %d", win, w_space);
-
-   // Minimal width for the input: a third of the window width, but at least
-   // 10 pixels, unless the window is less than 10 pixels wide.
+   // Show the pending space and ensure a minimal width for the input:
+   // a third of the window width, but at least 10 pixels, unless the
+   // window is less than 10 pixels wide.
    // TODO Make this configurable.
-   int w_input = MAX(win->area.w / 3, MIN(win->area.w, 10));
-   if(tb->cur_x != 0 && tb->cur_x + w_space + w_input > win->area.w)
-      // word does not fit -> break line
-      new_line(win);
-   else if(tb->cur_x != 0)
-      // word fits -> only add space before
-      tb->cur_x += w_space;
-
-   if(num_history >= MAX_HISTORY) {
-      // History buffer is full: remove oldest entry.
-      free(history[0]);
-      memmove(history, history + 1, (MAX_HISTORY - 1) * sizeof(Uint16*));
-      num_history = MAX_HISTORY - 1;
-   }
+   place(win, MAX(win->area.w / 3, MIN(win->area.w, 10)));
+   update(win); // The input is drawn directly on the screen.
 
    /*
-    * Dealing with the input history is done here (TODO should perhaps
-    * be moved into the "misc" part.
-    *
     * How history works:
     *
     * 1. You can move in the history using up and down, starting
@@ -366,24 +634,19 @@ glui32 nanoglk_wintextbuffer_get_line16(winid_t win, Uint16 *text,
     *    empty). All changes in the history are discarded and get
     *    lost.
     *
-    * The current position is kept in "history_pos". The history
-    * itself is stored in the global (but static) array "history",
-    * while the changes are stored in "history_repl". The latter
-    * contains NULL at the beginning, so you will often see something
-    * like:
-    *
-    *    history_repl[history_pos] ?
-    *       history_repl[history_pos] : history[history_pos]
+    * 4. Ctrl-R searches backwards in the history, see
+    *    search_history().
     *
-    * which results in the original (when never touched) or modified
-    * entry in the history.
+    * The current position is kept in "history_pos". The history
+    * itself is kept in "nanoglk_history" (see "misc/history.c"), while
+    * the changes are stored in the list "repl", which only contains
+    * the entries actually changed; history_line() returns either the
+    * original or the changed entry.
     */
 
    int state = -1; // As passed to nano_input_text16().
-   int history_pos = num_history;     // See above.
-   Uint16* history_repl[MAX_HISTORY]; // See above.
-   for(int i = 0; i < MAX_HISTORY; i++)
-      history_repl[i] = NULL;
+   int history_pos = nano_history_num(nanoglk_history); // See above.
+   struct repl *repl = NULL;                            // See above.
 
    while(1) {
       SDL_Event event;
@@ -391,65 +654,52 @@ glui32 nanoglk_wintextbuffer_get_line16(winid_t win, Uint16 *text,
                         win->area.x + tb->cur_x, win->area.y + tb->cur_y,
                         win->area.w - tb->cur_x,
                         nanoglk_buffer_font[style_Input]->text_height,
-                        nanoglk_buffer_font[style_Input]->font,
+                        nanoglk_buffer_font[style_Input]->metrics,
                         win->fg[style_Input], win->bg[style_Input],
                         &state);
       if(event.type == SDL_KEYDOWN)
          switch(event.key.keysym.sym) {
          case SDLK_RETURN:
             user_has_read(win);
+            add_input(win, text);
             new_line(win);
-
-            for(int i = 0; i < MAX_HISTORY; i++)
-               // history_repl is discarded. (And "text" can be used below.)
-               if(history_repl[i])
-                  free(history_repl[i]);
-
-            /* Store input at the end of the history, but only when it
-             * is different from the current last line, and if it is
-             * not empty.
-             */
-            if(text[0] &&
-               (num_history == 0 ||
-                strcmp16(text, history[num_history - 1]) != 0)) {
-               history[num_history] = strdup16(text);
-               num_history++;
-            }
-
+            free_repl(repl);
+            nano_history_add(nanoglk_history, text);
             return strlen16(text);
             
          case SDLK_UP:
             if(history_pos > 0) {
-               // Store changes.
-               if(history_repl[history_pos])
-                  free(history_repl[history_pos]);
-               history_repl[history_pos] = strdup16(text);
-
+               // Store changes, and display (possibly changed) history
+               // entry.
+               set_repl(&repl, history_pos, text);
                history_pos--;
-               // Display (possibly changed) history entry.
-               // TODO limit length
-               strcpy16(text, history_repl[history_pos] ?
-                        history_repl[history_pos] : history[history_pos]);
+               copy_line(text, history_line(repl, history_pos), max_len);
                state = -1;
             }
             break;
 
          case SDLK_DOWN:
-            if(history_pos < num_history) {
-               // Store changes. 
-               if(history_repl[history_pos])
-                  free(history_repl[history_pos]);
-               history_repl[history_pos] = strdup16(text);
-
+            if(history_pos < nano_history_num(nanoglk_history)) {
+               // Store changes, and display (possibly changed) history
+               // entry.
+               set_repl(&repl, history_pos, text);
                history_pos++;
-               // Display (possibly changed) history entry.
-               // TODO limit length
-               strcpy16(text, history_repl[history_pos] ?
-                        history_repl[history_pos] : history[history_pos]);
+               copy_line(text, history_line(repl, history_pos), max_len);
                state = -1;
             }
             break;
 
+         case SDLK_r:
+            if(event.key.keysym.mod & KMOD_CTRL) {
+               search_history(win, text, max_len);
+               state = -1;
+            }
+            break;
+
+         case SDLK_PAGEUP:
+            scrollback(win);
+            break;
+
          default:
             break;
          }
@@ -457,80 +707,303 @@ glui32 nanoglk_wintextbuffer_get_line16(winid_t win, Uint16 *text,
 }
 
 /*
- * Render the current word, i. e. return a NULL-terminated array of
- * SDL surfaces for the different parts (with different styles) of the
- * current word.
+ * Return a line of the history, or its changed version, if there is
+ * one. The position after the last line refers to the new line.
+ */
+const Uint16 *history_line(struct repl *repl, int pos)
+{
+   static const Uint16 empty[1] = { 0 };
+
+   for(; repl; repl = repl->next)
+      if(repl->pos == pos)
+         return repl->text;
+
+   return pos < nano_history_num(nanoglk_history) ?
+      nano_history_get(nanoglk_history, pos) : empty;
+}
+
+/*
+ * Store a changed line of the history.
+ */
+void set_repl(struct repl **repl, int pos, const Uint16 *text)
+{
+   struct repl *r;
+   for(r = *repl; r && r->pos != pos; r = r->next)
+      ;
+
+   if(r)
+      free(r->text);
+   else {
+      r = (struct repl*)nano_malloc(sizeof(struct repl));
+      r->pos = pos;
+      r->next = *repl;
+      *repl = r;
+   }
+
+   r->text = strdup16(text);
+}
+
+void free_repl(struct repl *repl)
+{
+   while(repl) {
+      struct repl *next = repl->next;
+      free(repl->text);
+      free(repl);
+      repl = next;
+   }
+}
+
+/*
+ * Copy a line into the input buffer, limited to "max_len" characters.
+ */
+void copy_line(Uint16 *text, const Uint16 *src, int max_len)
+{
+   int i;
+   for(i = 0; i < max_len && src[i]; i++)
+      text[i] = src[i];
+   text[i] = 0;
+}
+
+/*
+ * Incremental reverse search in the history, started by Ctrl-R during
+ * line input. Typed characters are added to the pattern, and the most
+ * recent line containing it is shown; Ctrl-R searches further back,
+ * and Backspace removes the last character of the pattern. Escape
+ * cancels the search, any other key ends it, and the line found is
+ * then copied into "text", where it can be edited.
+ */
+void search_history(winid_t win, Uint16 *text, int max_len)
+{
+   Uint16 pattern[MAX_PATTERN + 1];
+   int len = 0, found = -1;
+   int last = nano_history_num(nanoglk_history) - 1;
+   pattern[0] = 0;
+
+   while(1) {
+      draw_search(win, pattern,
+                  found >= 0 ? nano_history_get(nanoglk_history, found) :
+                  len == 0 ? text : pattern + len); // the latter is empty
+      nano_update(nanoglk_surface);
+
+      SDL_Event event;
+      nano_wait_event(&event);
+      if(event.type != SDL_KEYDOWN)
+         continue;
+
+      Uint16 c = event.key.keysym.unicode;
+      if(event.key.keysym.sym == SDLK_r &&
+         (event.key.keysym.mod & KMOD_CTRL)) {
+         if(found > 0) {
+            int f = nano_history_search(nanoglk_history, pattern, found - 1);
+            if(f != -1)
+               found = f;
+         }
+      } else if(event.key.keysym.sym == SDLK_BACKSPACE) {
+         if(len > 0) {
+            pattern[--len] = 0;
+            found = len > 0 ?
+               nano_history_search(nanoglk_history, pattern, last) : -1;
+         }
+      } else if(event.key.keysym.sym == SDLK_ESCAPE)
+         return;
+      else if(c >= 32 && c != 127) {
+         if(len < MAX_PATTERN) {
+            pattern[len++] = c;
+            pattern[len] = 0;
+            // The current line is searched again, it may still match.
+            found = nano_history_search(nanoglk_history, pattern,
+                                        found >= 0 ? found : last);
+         }
+      } else {
+         if(found >= 0)
+            copy_line(text, nano_history_get(nanoglk_history, found), max_len);
+         return;
+      }
+   }
+}
+
+/*
+ * Show the search pattern (with inverted colors) and the line found in
+ * place of the line input.
  */
-SDL_Surface **render_word(winid_t win)
+void draw_search(winid_t win, const Uint16 *pattern, const Uint16 *line)
 {
    struct textbuffer *tb = (struct textbuffer*)win->data;
+   struct nano_metrics *m = nanoglk_buffer_font[style_Input]->metrics;
+
+   SDL_Rect r = { win->area.x + tb->cur_x, win->area.y + tb->cur_y,
+                  win->area.w - tb->cur_x,
+                  nanoglk_buffer_font[style_Input]->text_height };
+   nano_fill_rect(nanoglk_surface, win->bg[style_Input], r.x, r.y, r.w, r.h);
+
+   SDL_Rect old_clip;
+   SDL_GetClipRect(nanoglk_surface, &old_clip);
+   SDL_SetClipRect(nanoglk_surface, &r);
+
+   SDL_Surface *t = nano_render16(m, pattern, strlen16(pattern),
+                                  win->bg[style_Input], win->fg[style_Input]);
+   SDL_Rect r1 = { r.x, r.y, t->w, t->h };
+   SDL_BlitSurface(t, NULL, nanoglk_surface, &r1);
+   int x = r.x + t->w + nanoglk_buffer_font[style_Input]->space_width;
+   SDL_FreeSurface(t);
+
+   t = nano_render16(m, line, strlen16(line),
+                     win->fg[style_Input], win->bg[style_Input]);
+   SDL_Rect r2 = { x, r.y, t->w, t->h };
+   SDL_BlitSurface(t, NULL, nanoglk_surface, &r2);
+   SDL_FreeSurface(t);
+
+   SDL_SetClipRect(nanoglk_surface, &old_clip);
+}
 
-   // First, calculate how many times the style changes, and so the length
-   // of the returned array.
-   int i, num_parts = 0;
-   for(i = 0; i < tb->curword_len; i++)
-      if(i == 0 || tb->curword_styles[i] != tb->curword_styles[i - 1])
-         num_parts++;
-
-   // Render the parts of the word.
-   SDL_Surface **t =
-      (SDL_Surface**)nano_malloc((num_parts + 1) * sizeof(SDL_Surface*));
-   int word_start = 0, word_end;
-   for(i = 0; i < num_parts; i++) {
-      Uint16 saved; /* Since the TTF rendering functions expect a
-                       0-terminated Uint16 array, we simply set the
-                       end of a part to 0, but save the character
-                       (which is the first character of the next part)
-                       before in this variable. */
-
-      if(i < num_parts - 1) {
-         word_end = word_start + 1;
-         // Search for change of style.
-         while(tb->curword_styles[word_end - 1] == tb->curword_styles[word_end])
-            word_end++;
-         saved = tb->curword[word_end];
-         tb->curword[word_end] = 0;
-      } else
-         tb->curword[tb->curword_len] = 0; // Last part, saving not neccessary.
-      
-      int styl = tb->curword_styles[word_start];
-      t[i] =
-         TTF_RenderUNICODE_Shaded(nanoglk_buffer_font[styl]->font,
-                                  tb->curword + word_start,
-                                  win->fg[styl], win->bg[styl]);
-      
-      if(i < num_parts - 1)
-         tb->curword[word_end] = saved;
+/*
+ * Return the end of the part of the current word (i. e. the first
+ * character with a different style, or the word length) starting at
+ * "start".
+ */
+int part_end(winid_t win, int start)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
 
-      word_start = word_end;
+   int end = start + 1;
+   while(end < tb->curword_len &&
+         tb->curword_styles[end - 1] == tb->curword_styles[end])
+      end++;
+   return end;
+}
+
+/*
+ * Preserve the text of a finished line input in the text store, as one
+ * word, and end the line.
+ */
+void add_input(winid_t win, Uint16 *text)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+
+   int len = MIN(strlen16(text), MAX_WORD_LEN);
+   if(len > 0) {
+      glui32 styles[len];
+      for(int i = 0; i < len; i++)
+         styles[i] = style_Input;
+      nanoglk_textstore_add_word(tb->store, text, styles, len);
+      tb->line_height =
+         MAX(tb->line_height, nanoglk_buffer_font[style_Input]->text_height);
    }
 
-   t[num_parts] = NULL;
-   return t;
+   nanoglk_textstore_add_break(tb->store,
+                               nanoglk_buffer_font[win->cur_styl]->text_height);
 }
 
 /*
- * Calculate the width of a rendered word (array of SDL surfaces) as
- * created by render_word().
+ * Draw the visible part of the window again from the text store, after
+ * the text has been rewrapped. The last line is placed at the bottom
+ * when the text does not fit into the window; otherwise the text starts
+ * at the top.
  */
-int width_word(SDL_Surface **t)
+void redraw(winid_t win)
 {
-   int i, w = 0;
-   for(i = 0; t[i]; i++)
-      w += t[i]->w;
-   return w;
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   struct nanoglk_textstore *ts = tb->store;
+
+   // Search backwards the first visible line.
+   int last = nanoglk_textstore_num_lines(ts) - 1;
+   int y_last = win->area.h - nanoglk_textstore_line_height(ts, last);
+   int y = y_last;
+   for(int i = last; i > 0 && y > 0; i--)
+      y -= nanoglk_textstore_line_height(ts, i - 1);
+   if(y > 0)
+      // All text fits into the window.
+      y_last -= y;
+
+   draw_lines(win, y_last);
+
+   tb->cur_x = nanoglk_textstore_line_width(ts, last);
+   tb->cur_y = y_last;
+   tb->line_height = nanoglk_textstore_line_height(ts, last);
+   tb->last_line_height =
+      last > 0 ? nanoglk_textstore_line_height(ts, last - 1) : 0;
+   // All this text has been visible before.
+   tb->read_until = tb->cur_y;
+   tb->scroll = tb->pending_lines = 0;
 }
 
 /*
- * Free a rendered word (array of SDL surfaces) as created by
- * render_word().
+ * Clear the window and draw the lines from the text store, so that the
+ * last line starts at "y_last" (relative to the window area). Only the
+ * lines actually visible are drawn (and so rendered); for the others,
+ * only the heights are summed up.
  */
-void free_word(SDL_Surface **t)
+void draw_lines(winid_t win, int y_last)
 {
-   int i;
-   for(i = 0; t[i]; i++)
-      SDL_FreeSurface(t[i]);
-   free(t);
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   struct nanoglk_textstore *ts = tb->store;
+
+   SDL_FillRect(nanoglk_surface, &win->area,
+                SDL_MapRGB(nanoglk_surface->format,
+                           win->bg[win->cur_styl].r, win->bg[win->cur_styl].g,
+                           win->bg[win->cur_styl].b));
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
+
+   int y = y_last;
+   for(int i = nanoglk_textstore_num_lines(ts) - 1; i >= 0; i--) {
+      if(y < win->area.h &&
+         y + nanoglk_textstore_line_height(ts, i) > 0)
+         nanoglk_textstore_draw_line(ts, i, win, y);
+      if(y <= 0 || i == 0)
+         break;
+      y -= nanoglk_textstore_line_height(ts, i - 1);
+   }
+}
+
+/*
+ * Show older text, which has been scrolled out of the window. Called
+ * when the user presses PageUp during line input; then, PageUp and
+ * PageDown scroll by pages, and any other key (or scrolling down to
+ * the end) returns to the current text.
+ */
+void scrollback(winid_t win)
+{
+   struct textbuffer *tb = (struct textbuffer*)win->data;
+   struct nanoglk_textstore *ts = tb->store;
+
+   // Maximal scrolling: until the first preserved line is at the top.
+   int max_back = -tb->cur_y;
+   for(int i = 0; i < nanoglk_textstore_num_lines(ts) - 1; i++)
+      max_back += nanoglk_textstore_line_height(ts, i);
+   if(max_back <= 0)
+      return;
+
+   // Keep one line from the previous page visible.
+   int page = MAX(win->area.h - nanoglk_buffer_font[style_Normal]->text_height,
+                  1);
+
+   nano_save_window(nanoglk_surface,
+                    win->area.x, win->area.y, win->area.w, win->area.h);
+
+   int back = MIN(page, max_back);
+   while(back > 0) {
+      draw_lines(win, tb->cur_y + back);
+      nano_update(nanoglk_surface);
+
+      SDL_Event event;
+      nano_wait_event(&event);
+      if(event.type == SDL_KEYDOWN)
+         switch(event.key.keysym.sym) {
+         case SDLK_PAGEUP:
+            back = MIN(back + page, max_back);
+            break;
+
+         case SDLK_PAGEDOWN:
+            back -= page;
+            break;
+
+         default:
+            back = 0;
+            break;
+         }
+   }
+
+   nano_restore_window(nanoglk_surface);
 }
 
 /*
@@ -551,6 +1024,11 @@ void new_line(winid_t win)
 
    int h = tb->line_height > 0 ?
       tb->line_height : nanoglk_buffer_font[win->cur_styl]->text_height;
+
+   // The text store has already begun the new line; if drawing is
+   // deferred, it has to be drawn later, too.
+   if(tb->pending_lines > 0)
+      tb->pending_lines++;
    ensure_space(win, h);
 
    tb->cur_x = 0;
@@ -564,9 +1042,10 @@ void new_line(winid_t win)
 
 /*
  * Makes sure that there is some space at the bottom of the window. If
- * there is not enough space, scroll down. Also, make sure that the
- * user was able to read all text, i. e. regard "read_until"; display
- * a "- more -" message and wait for a key when neccessary.
+ * there is not enough space, scroll down; this is deferred until the
+ * next call of update(). Also, make sure that the user was able to
+ * read all text, i. e. regard "read_until"; display a "- more -"
+ * message and wait for a key when neccessary.
  */
 void ensure_space(winid_t win, int space)
 {
@@ -581,7 +1060,8 @@ void ensure_space(winid_t win, int space)
 
       if(d > tb->read_until) {
          // TODO Maybe scroll some bit already?
-         // Display "- more -" and wait for a key.
+         // Show the text so far, display "- more -" and wait for a key.
+         update(win);
          Uint16 more[] = { 0x2014, ' ', 'm', 'o', 'r', 'e', ' ', 0x2014, 0 };
          SDL_Surface *t =
             TTF_RenderUNICODE_Shaded(nanoglk_buffer_font[style_Input]->font,
@@ -601,7 +1081,7 @@ void ensure_space(winid_t win, int space)
          SDL_BlitSurface(t, &r1, nanoglk_surface, &r2);
          SDL_FreeSurface(t);
 
-         SDL_Flip(nanoglk_surface);
+         nano_update(nanoglk_surface);
 
          wait_for_key();
 
@@ -611,20 +1091,10 @@ void ensure_space(winid_t win, int space)
          nano_restore_window(nanoglk_surface);
       }
       
-      // Copy (scroll down).
-      SDL_Rect r1 = { win->area.x, win->area.y + d,
-                      win->area.w, win->area.h - d };
-      SDL_Rect r2 = { win->area.x, win->area.y, win->area.w, win->area.h - d };
-      SDL_BlitSurface(nanoglk_surface, &r1, nanoglk_surface, &r2);
-
-      // Clear new, free area.
-      SDL_Rect r = { win->area.x, win->area.y + win->area.h - d,
-                     win->area.w, d };
-      SDL_FillRect(nanoglk_surface, &r,
-                   SDL_MapRGB(nanoglk_surface->format,
-                              win->bg[win->cur_styl].r,
-                              win->bg[win->cur_styl].g,
-                              win->bg[win->cur_styl].b));
+      // Scroll down, later. The current line is drawn again then.
+      tb->scroll += d;
+      if(tb->pending_lines == 0)
+         tb->pending_lines = 1;
 
       tb->cur_y -= d;
       tb->read_until -= d;
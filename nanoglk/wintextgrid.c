@@ -21,29 +21,63 @@
  * Handling text grid windows. Most functions are called from the
  * general window functions defined in "window.c".
  *
- * TODO: Text rendering en bloc, more efficient? Would restrict
- * rendering to the one fixed width font. (But isn't this actually
- * what grid windows are intended for?). To solve this: distinguish
- * between general and the latter case?
+ * All cells have the same size, taken from the "normal" font. The
+ * printable Latin-1 characters of each style are rendered once into
+ * an atlas (see get_atlas()), so drawing a cell is simply copying a
+ * part of it; other characters are rendered separately.
  */
 
 #include "nanoglk.h"
 
+/*
+ * The content of a cell.
+ */
+struct cell
+{
+   Uint16 ch;
+   Uint8 styl;
+};
+
 /*
  * The structure used for win->data.
+ *
+ * Output only changes "cells"; the changed cells are drawn by
+ * nanoglk_wintextgrid_flush(). For each row, the range of changed
+ * cells is kept; within this range, only the cells which differ from
+ * what is actually shown ("shown") are drawn.
  */
 struct textgrid
 {
-   int cur_x, cur_y;  // current position to insert new text
+   int cur_x, cur_y;      // current position to insert new text, in cells
+   int cols, rows;        /* size in cells; the last column and row may be
+                             only partly visible */
+   struct cell *cells;    // the content, row by row
+   struct cell *shown;    // what is shown on the screen, same order
+   int *dirty_from, *dirty_to; /* for each row, the range of changed cells
+                                  ("dirty_to" is exclusive) */
+   SDL_Surface *atlas[style_NUMSTYLES]; // see get_atlas(); NULL if not needed
 };
 
+static void alloc_cells(winid_t win);
+static void free_cells(winid_t win);
+static void blank(winid_t win, struct cell *cells);
+static void draw_cell(winid_t win, int x, int y);
+static int in_atlas(Uint16 ch);
+static SDL_Surface *get_atlas(winid_t win, int styl);
+static void new_line(winid_t win);
 
 /*
  * Initialize a text grid window.
  */
 void nanoglk_wintextgrid_init(winid_t win)
 {
-   win->data = nano_malloc(sizeof(struct textgrid));
+   struct textgrid *tg =
+      (struct textgrid*)nano_malloc(sizeof(struct textgrid));
+   tg->cur_x = tg->cur_y = 0;
+   for(int i = 0; i < style_NUMSTYLES; i++)
+      tg->atlas[i] = NULL;
+   win->data = tg;
+   alloc_cells(win);
    nanoglk_wintextgrid_clear(win);
 }
 
@@ -52,6 +86,11 @@ void nanoglk_wintextgrid_init(winid_t win)
  */
 void nanoglk_wintextgrid_free(winid_t win)
 {
+   struct textgrid *tg = (struct textgrid*)win->data;
+   for(int i = 0; i < style_NUMSTYLES; i++)
+      if(tg->atlas[i])
+         SDL_FreeSurface(tg->atlas[i]);
+   free_cells(win);
    free(win->data);
 }
 
@@ -64,41 +103,52 @@ void nanoglk_wintextgrid_clear(winid_t win)
    tg->cur_x = tg->cur_y = 0;
 
    // The current style is used for the background.
+   blank(win, tg->cells);
+   blank(win, tg->shown);
+   for(int y = 0; y < tg->rows; y++)
+      tg->dirty_from[y] = tg->dirty_to[y] = 0;
+
    SDL_FillRect(nanoglk_surface, &win->area,
                 SDL_MapRGB(nanoglk_surface->format,
                            win->bg[win->cur_styl].r, win->bg[win->cur_styl].g,
                            win->bg[win->cur_styl].b));
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
 }
 
 /*
- * Resize a text grid window.
+ * Resize a text grid window. The content is preserved as far as it
+ * still fits, and drawn again.
  */
 void nanoglk_wintextgrid_resize(winid_t win, SDL_Rect *area)
 {
-   // Save the current contents in a new surface "s".
-   SDL_Rect r1 = { win->area.x, win->area.y,
-                   MIN(win->area.w, area->w), MIN(win->area.h, area->h) };
-   SDL_Rect r2 = { 0, 0, r1.w, r2.w };
-   SDL_Surface *s =
-      SDL_CreateRGBSurface(SDL_SWSURFACE, r2.w, r2.h, nanoglk_screen_depth,
-                           0, 0, 0, 0); /* TODO Argument [RGB]mask? Currently
-                                           passed 0. */
-   SDL_BlitSurface(nanoglk_surface, &r1, s, &r2);
+   struct textgrid *tg = (struct textgrid*)win->data;
+   int old_cols = tg->cols, old_rows = tg->rows;
+   struct cell *old_cells = tg->cells;
+   tg->cells = NULL;
+   free_cells(win);
 
    win->area = *area;
-   // Clear new area ...
+   alloc_cells(win);
+
+   // Clear new area; the new cells are empty ...
+   blank(win, tg->cells);
+   blank(win, tg->shown);
    SDL_FillRect(nanoglk_surface, &win->area,
                 SDL_MapRGB(nanoglk_surface->format,
                            win->bg[win->cur_styl].r, win->bg[win->cur_styl].g,
                            win->bg[win->cur_styl].b));
+   nano_damage(win->area.x, win->area.y, win->area.w, win->area.h);
 
-   // ... and copy the old contents.
-   SDL_Rect r3 = { win->area.x, win->area.y, r1.w, r2.w };
-   SDL_BlitSurface(s, &r2, nanoglk_surface, &r3);
-   SDL_FreeSurface(s);
+   // ... then copy the old content, which is drawn immediately.
+   for(int y = 0; y < MIN(old_rows, tg->rows); y++) {
+      for(int x = 0; x < MIN(old_cols, tg->cols); x++)
+         tg->cells[y * tg->cols + x] = old_cells[y * old_cols + x];
+      tg->dirty_from[y] = 0;
+      tg->dirty_to[y] = tg->cols;
+   }
+   free(old_cells);
 
-   // (One could also copy directly, and clear new areas, when the window
-   // has become larger; but this would be more complicated.)
+   nanoglk_wintextgrid_flush(win);
 }
 
 /*
@@ -107,31 +157,198 @@ void nanoglk_wintextgrid_resize(winid_t win, SDL_Rect *area)
 void nanoglk_wintextgrid_move_cursor(winid_t win, glui32 xpos, glui32 ypos)
 {
    struct textgrid *tg = (struct textgrid*)win->data;
-   tg->cur_x = xpos * nanoglk_grid_font[style_Normal]->space_width;
-   tg->cur_y = ypos * nanoglk_grid_font[style_Normal]->text_height;
+   // Positions outside of the window are kept (but nothing is drawn there).
+   tg->cur_x = MIN(xpos, (glui32)tg->cols);
+   tg->cur_y = MIN(ypos, (glui32)tg->rows);
 }
 
 /*
- * Flush a text grid window, i. e. display all pending output.
+ * Flush a text grid window, i. e. display all pending output: draw
+ * the cells, which have changed since the last call.
  */
 void nanoglk_wintextgrid_flush(winid_t win)
 {
-   // Nothing to to, everything is drawn immediately. (May change, see TODO
-   // at the beginning on this file.)
+   struct textgrid *tg = (struct textgrid*)win->data;
+   int gw = nanoglk_grid_font[style_Normal]->space_width;
+   int gh = nanoglk_grid_font[style_Normal]->text_height;
+
+   SDL_Rect old_clip;
+   SDL_GetClipRect(nanoglk_surface, &old_clip);
+   SDL_SetClipRect(nanoglk_surface, &win->area);
+
+   for(int y = 0; y < tg->rows; y++) {
+      int x1 = tg->cols, x2 = 0; // the cells actually drawn
+      for(int x = tg->dirty_from[y]; x < tg->dirty_to[y]; x++) {
+         int i = y * tg->cols + x;
+         if(tg->cells[i].ch != tg->shown[i].ch ||
+            tg->cells[i].styl != tg->shown[i].styl) {
+            draw_cell(win, x, y);
+            tg->shown[i] = tg->cells[i];
+            x1 = MIN(x1, x);
+            x2 = x + 1;
+         }
+      }
+
+      if(x1 < x2)
+         nano_damage(win->area.x + x1 * gw, win->area.y + y * gh,
+                     (x2 - x1) * gw, gh);
+      tg->dirty_from[y] = tg->dirty_to[y] = 0;
+   }
+
+   SDL_SetClipRect(nanoglk_surface, &old_clip);
+}
+
+/*
+ * Allocate the cells for the current size of the window.
+ */
+void alloc_cells(winid_t win)
+{
+   struct textgrid *tg = (struct textgrid*)win->data;
+
+   // Width and height of a grid unit. Taken from the "normal" font, in the hope
+   // that all fonts for grid windows have exactly same measurements.
+   int gw = nanoglk_grid_font[style_Normal]->space_width;
+   int gh = nanoglk_grid_font[style_Normal]->text_height;
+
+   // Rounded up, as in glk_window_get_size().
+   tg->cols = (win->area.w + gw - 1) / gw;
+   tg->rows = (win->area.h + gh - 1) / gh;
+
+   if(tg->cols == 0 || tg->rows == 0) {
+      // Nothing to allocate; nano_malloc(0) may fail (uClibc returns NULL).
+      tg->cols = tg->rows = 0;
+      tg->cells = tg->shown = NULL;
+      tg->dirty_from = tg->dirty_to = NULL;
+   } else {
+      tg->cells =
+         (struct cell*)nano_malloc(tg->cols * tg->rows * sizeof(struct cell));
+      tg->shown =
+         (struct cell*)nano_malloc(tg->cols * tg->rows * sizeof(struct cell));
+      tg->dirty_from = (int*)nano_malloc(tg->rows * sizeof(int));
+      tg->dirty_to = (int*)nano_malloc(tg->rows * sizeof(int));
+   }
+   for(int y = 0; y < tg->rows; y++)
+      tg->dirty_from[y] = tg->dirty_to[y] = 0;
+   tg->cur_x = MIN(tg->cur_x, tg->cols);
+   tg->cur_y = MIN(tg->cur_y, tg->rows);
+}
+
+void free_cells(winid_t win)
+{
+   struct textgrid *tg = (struct textgrid*)win->data;
+   if(tg->cells)
+      free(tg->cells);
+   free(tg->shown);
+   free(tg->dirty_from);
+   free(tg->dirty_to);
+}
+
+/*
+ * Fill all cells with spaces of the current style.
+ */
+void blank(winid_t win, struct cell *cells)
+{
+   struct textgrid *tg = (struct textgrid*)win->data;
+   for(int i = 0; i < tg->cols * tg->rows; i++) {
+      cells[i].ch = ' ';
+      cells[i].styl = win->cur_styl;
+   }
+}
+
+/*
+ * Draw a cell on the screen: copied from the atlas, or, for other
+ * characters, taken from the glyph cache (see "misc/glyph.c"); glyphs
+ * are cut at the cell borders.
+ */
+void draw_cell(winid_t win, int x, int y)
+{
+   struct textgrid *tg = (struct textgrid*)win->data;
+   struct cell *c = &tg->cells[y * tg->cols + x];
+   int gw = nanoglk_grid_font[style_Normal]->space_width;
+   int gh = nanoglk_grid_font[style_Normal]->text_height;
+
+   SDL_Rect r = { win->area.x + x * gw, win->area.y + y * gh, gw, gh };
+   if(in_atlas(c->ch)) {
+      SDL_Rect ra = { c->ch * gw, 0, gw, gh };
+      SDL_BlitSurface(get_atlas(win, c->styl), &ra, nanoglk_surface, &r);
+      return;
+   }
+
+   SDL_FillRect(nanoglk_surface, &r,
+                SDL_MapRGB(nanoglk_surface->format,
+                           win->bg[c->styl].r, win->bg[c->styl].g,
+                           win->bg[c->styl].b));
+
+   SDL_Surface *t = nano_render16(nanoglk_grid_font[c->styl]->metrics,
+                                  &c->ch, 1, win->fg[c->styl], win->bg[c->styl]);
+   SDL_Rect r1 = { 0, 0, gw, gh };
+   SDL_Rect r2 = { win->area.x + x * gw, win->area.y + y * gh, gw, gh };
+   SDL_BlitSurface(t, &r1, nanoglk_surface, &r2);
+   SDL_FreeSurface(t);
+}
+
+/*
+ * Return TRUE, if a character is contained in the atlas: the printable
+ * Latin-1 characters.
+ */
+int in_atlas(Uint16 ch)
+{
+   return (ch >= 32 && ch <= 126) || (ch >= 160 && ch <= 255);
+}
+
+/*
+ * Return the atlas of a style, which is rendered when first needed:
+ * all characters for which in_atlas() returns TRUE, in one row of
+ * cells (character "c" at "c" times the cell width), with the format
+ * of the screen, so that blitting needs no conversion.
+ */
+SDL_Surface *get_atlas(winid_t win, int styl)
+{
+   struct textgrid *tg = (struct textgrid*)win->data;
+
+   if(tg->atlas[styl] == NULL) {
+      int gw = nanoglk_grid_font[style_Normal]->space_width;
+      int gh = nanoglk_grid_font[style_Normal]->text_height;
+      SDL_PixelFormat *f = nanoglk_surface->format;
+      SDL_Surface *a =
+         SDL_CreateRGBSurface(SDL_SWSURFACE, 256 * gw, gh, f->BitsPerPixel,
+                              f->Rmask, f->Gmask, f->Bmask, f->Amask);
+      if(a == NULL)
+         nano_fail("Cannot create surface: %s", SDL_GetError());
+      SDL_FillRect(a, NULL, SDL_MapRGB(a->format, win->bg[styl].r,
+                                       win->bg[styl].g, win->bg[styl].b));
+
+      for(Uint16 ch = 0; ch < 256; ch++)
+         if(in_atlas(ch)) {
+            SDL_Surface *t = nano_render16(nanoglk_grid_font[styl]->metrics,
+                                           &ch, 1, win->fg[styl], win->bg[styl]);
+            SDL_Rect r1 = { 0, 0, MIN(t->w, gw), MIN(t->h, gh) };
+            SDL_Rect r2 = { ch * gw, 0, r1.w, r1.h };
+            SDL_BlitSurface(t, &r1, a, &r2);
+            SDL_FreeSurface(t);
+         }
+
+      nano_trace("win %p: atlas for style %d rendered", win, styl);
+      tg->atlas[styl] = a;
+   }
+
+   return tg->atlas[styl];
 }
 
 /*
  * Begin a new line in a text window.
  */
-static void new_line(winid_t win)
+void new_line(winid_t win)
 {
    struct textgrid *tg = (struct textgrid*)win->data;
    tg->cur_x = 0;
-   tg->cur_y += nanoglk_grid_font[style_Normal]->text_height;
+   tg->cur_y++;
 }
 
 /*
- * Puts a character into a text grid window.
+ * Puts a character into a text grid window. Only the cell is changed,
+ * and only when the content is different; see
+ * nanoglk_wintextgrid_flush().
  */
 void nanoglk_wintextgrid_put_char(winid_t win, glui32 c)
 {
@@ -145,28 +362,34 @@ void nanoglk_wintextgrid_put_char(winid_t win, glui32 c)
       nano_trace("nanoglk_wintextgrid_put_char(%p, 0x%04x) at (%d, %d)",
                  win, c, tg->cur_x, tg->cur_y);
 
-   // Width and height of a grid unit. Taken from the "normal" font, in the hope
-   // that all fonts for grid windows have exactly same measurements.
-   int gw = nanoglk_grid_font[style_Normal]->space_width;
-   int gh = nanoglk_grid_font[style_Normal]->text_height;
+   if(c == '\n') {
+      new_line(win);
+      return;
+   }
 
-   if(c == '\n')
+   if(tg->cur_x >= tg->cols) // cursor moved beyond the right border
       new_line(win);
 
    // No scrolling! Anything below the bottom border is ignored.
-   if(tg->cur_y < win->area.h) {
-      Uint16 str[2] = { c, 0 };
-      SDL_Surface *t =
-         TTF_RenderUNICODE_Shaded(nanoglk_grid_font[win->cur_styl]->font, str,
-                                  win->fg[win->cur_styl],
-                                  win->bg[win->cur_styl]);
-      SDL_Rect r1 = { 0, 0, gw, gh };
-      SDL_Rect r2 = { tg->cur_x, tg->cur_y, gw, gh };
-      SDL_BlitSurface(t, &r1, nanoglk_surface, &r2);
-      SDL_FreeSurface(t);
-
-      tg->cur_x += gw;
-      if(tg->cur_x >= win->area.w) // right border of the window
+   if(tg->cur_y < tg->rows && tg->cur_x < tg->cols) {
+      struct cell *cell = &tg->cells[tg->cur_y * tg->cols + tg->cur_x];
+      if(cell->ch != c || cell->styl != win->cur_styl) {
+         cell->ch = c;
+         cell->styl = win->cur_styl;
+
+         // Extend the range of changed cells.
+         int *from = &tg->dirty_from[tg->cur_y], *to = &tg->dirty_to[tg->cur_y];
+         if(*from >= *to) {
+            *from = tg->cur_x;
+            *to = tg->cur_x + 1;
+         } else {
+            *from = MIN(*from, tg->cur_x);
+            *to = MAX(*to, tg->cur_x + 1);
+         }
+      }
+
+      tg->cur_x++;
+      if(tg->cur_x >= tg->cols) // right border of the window
          new_line(win);
    }
 }
@@ -24,10 +24,38 @@
 
 #include "misc/misc.h"
 
+static int failures = 0;
+
+static void check(int ok, const char *what, int n);
+static void test_utf8(void);
+static void test_utf8_split(void);
+static void test_utf8_invalid(void);
+static void test_ucs4be(void);
+static void test_memchr32(void);
+static void test_utf8from16(void);
+
+// Characters at the borders of the UTF-8 sequence lengths.
+static const Uint32 samples[] = {
+   'a', 0x7f, 0x80, 0xe9, 0x7ff, 0x800, 0x20ac, 0xd7ff, 0xe000, 0xfffd,
+   0xffff, 0x10000, 0x1f600, 0x10ffff
+};
+#define NUM_SAMPLES (sizeof(samples) / sizeof(samples[0]))
+
+// Enough to cross the 4, 8 and 16 element steps of the SIMD code.
+#define MAX_LEN 40
+
 int main(int argc, char **argv)
 {
    nano_init(argc, argv, 0);
 
+   test_utf8();
+   test_utf8_split();
+   test_utf8_invalid();
+   test_ucs4be();
+   test_memchr32();
+   test_utf8from16();
+   printf("%d check(s) failed\n", failures);
+
    char buf[1024];
    nano_expand_env("The value of ${HOME}/foo/bar", buf, 1023);
    printf("'The value of ${HOME}/foo/bar' is: %s\n", buf);
@@ -37,3 +65,188 @@ int main(int argc, char **argv)
    return 0;
 }
 
+/*
+ * Print only failed checks; "n" identifies the case.
+ */
+void check(int ok, const char *what, int n)
+{
+   if(!ok) {
+      printf("FAILED: %s (%d)\n", what, n);
+      failures++;
+   }
+}
+
+/*
+ * Encode and decode again: ASCII strings of all lengths up to MAX_LEN,
+ * with one other character at each position.
+ */
+void test_utf8(void)
+{
+   Uint32 src[MAX_LEN], dest[MAX_LEN];
+   char buf[4 * MAX_LEN];
+
+   for(int len = 0; len <= MAX_LEN; len++)
+      for(int k = 0; k < NUM_SAMPLES; k++)
+         for(int p = 0; p < MAX(len, 1); p++) {
+            for(int i = 0; i < len; i++)
+               src[i] = 'A' + i % 26;
+            if(len > 0)
+               src[p] = samples[k];
+
+            int n = nano_utf8_encode(src, len, buf), used;
+            int m = nano_utf8_decode(buf, n, dest, len, &used);
+            check(m == len && used == n &&
+                  memcmp(src, dest, len * sizeof(Uint32)) == 0,
+                  "UTF-8 round trip", len);
+         }
+
+   // Not more than "max" characters are decoded.
+   int used;
+   check(nano_utf8_decode("abc\xc3\xa9", 5, dest, 3, &used) == 3 && used == 3,
+         "UTF-8 decoding limited by max", 0);
+}
+
+/*
+ * Decode UTF-8 in pieces of different sizes; sequences split between
+ * two pieces must be kept for the next call.
+ */
+void test_utf8_split(void)
+{
+   Uint32 src[NUM_SAMPLES * 3], dest[NUM_SAMPLES * 3];
+   char buf[4 * NUM_SAMPLES * 3];
+   int len = NUM_SAMPLES * 3;
+
+   for(int i = 0; i < len; i++)
+      src[i] = i % 3 ? samples[i / 3] : 'x';
+   int n = nano_utf8_encode(src, len, buf);
+
+   for(int piece = 1; piece <= 20; piece++) {
+      int m = 0, start = 0; // "start" is the first byte not decoded yet
+      for(int end = MIN(piece, n); start < n; end = MIN(end + piece, n)) {
+         int used;
+         m += nano_utf8_decode(buf + start, end - start, dest + m, len - m,
+                               &used);
+         start += used;
+         if(end == n && used == 0)
+            break;
+      }
+
+      check(m == len && start == n &&
+            memcmp(src, dest, len * sizeof(Uint32)) == 0,
+            "UTF-8 decoding in pieces", piece);
+   }
+}
+
+/*
+ * Invalid UTF-8 must become U+FFFD, and only the first byte of an
+ * invalid sequence is skipped.
+ */
+void test_utf8_invalid(void)
+{
+   static const struct {
+      const char *src;
+      Uint32 expected[5];
+   } cases[] = {
+      { "\x80", { 0xfffd } },                          // lone continuation
+      { "\xc3(", { 0xfffd, '(' } },                    // missing continuation
+      { "\xc0\x80", { 0xfffd, 0xfffd } },               // overlong U+0000
+      { "\xc1\xbf", { 0xfffd, 0xfffd } },               // overlong U+007F
+      { "\xe0\x9f\xbf", { 0xfffd, 0xfffd, 0xfffd } },   // overlong U+07FF
+      { "\xf0\x8f\xbf\xbf", { 0xfffd, 0xfffd, 0xfffd, 0xfffd } },
+                                                      // overlong U+FFFF
+      { "\xed\xa0\x80", { 0xfffd, 0xfffd, 0xfffd } },   // U+D800
+      { "\xed\xbf\xbf", { 0xfffd, 0xfffd, 0xfffd } },   // U+DFFF
+      { "\xf4\x90\x80\x80", { 0xfffd, 0xfffd, 0xfffd, 0xfffd } },
+                                                      // 0x110000
+      { "\xf5\x80\x80\x80", { 0xfffd, 0xfffd, 0xfffd, 0xfffd } },
+      { "\xf7\xbf\xbf\xbf", { 0xfffd, 0xfffd, 0xfffd, 0xfffd } },
+      { "\xff", { 0xfffd } },
+      { "\xed\x9f\xbf", { 0xd7ff } },                  // valid neighbours
+      { "\xf4\x8f\xbf\xbf", { 0x10ffff } },
+   };
+
+   for(int c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+      int len = strlen(cases[c].src), used, num;
+      for(num = 0; num < 5 && cases[c].expected[num]; num++)
+         ;
+      Uint32 dest[5];
+      int m = nano_utf8_decode(cases[c].src, len, dest, 5, &used);
+      check(m == num && used == len &&
+            memcmp(dest, cases[c].expected, num * sizeof(Uint32)) == 0,
+            "invalid UTF-8", c);
+   }
+
+   // An incomplete sequence at the end is left for the next call.
+   Uint32 dest[2];
+   int used;
+   check(nano_utf8_decode("a\xe2\x82", 3, dest, 2, &used) == 1 && used == 1,
+         "incomplete UTF-8 at the end", 0);
+
+   // The other direction: surrogates and too large values.
+   Uint32 src[] = { 0xd800, 0xdfff, 0x110000 };
+   char buf[12];
+   check(nano_utf8_encode(src, 3, buf) == 9 &&
+         memcmp(buf, "\xef\xbf\xbd\xef\xbf\xbd\xef\xbf\xbd", 9) == 0,
+         "UTF-8 encoding of invalid characters", 0);
+}
+
+void test_ucs4be(void)
+{
+   Uint32 src[MAX_LEN], dest[MAX_LEN];
+   char buf[4 * MAX_LEN];
+
+   for(int len = 0; len <= MAX_LEN; len++) {
+      for(int i = 0; i < len; i++)
+         src[i] = samples[i % NUM_SAMPLES] | (i << 24);
+      nano_ucs4be_encode(src, len, buf);
+
+      int ok = 1;
+      for(int i = 0; i < len; i++)
+         ok = ok && (Uint8)buf[4 * i] == src[i] >> 24 &&
+            (Uint8)buf[4 * i + 1] == ((src[i] >> 16) & 0xff) &&
+            (Uint8)buf[4 * i + 2] == ((src[i] >> 8) & 0xff) &&
+            (Uint8)buf[4 * i + 3] == (src[i] & 0xff);
+      check(ok, "UCS-4 byte order", len);
+
+      nano_ucs4be_decode(buf, len, dest);
+      check(memcmp(src, dest, len * sizeof(Uint32)) == 0,
+            "UCS-4 round trip", len);
+   }
+}
+
+void test_memchr32(void)
+{
+   Uint32 s[MAX_LEN];
+
+   for(int len = 0; len <= MAX_LEN; len++) {
+      for(int i = 0; i < len; i++)
+         s[i] = 0x10000 + i;
+      check(nano_memchr32(s, '\n', len) == NULL, "memchr32, not found", len);
+
+      for(int p = 0; p < len; p++) {
+         s[p] = '\n';
+         if(p + 1 < len)
+            s[len - 1] = '\n'; // only the first one is found
+         check(nano_memchr32(s, '\n', len) == s + p, "memchr32", len);
+         for(int i = 0; i < len; i++)
+            s[i] = 0x10000 + i;
+      }
+   }
+}
+
+/*
+ * Characters from U+0800 on need three bytes.
+ */
+void test_utf8from16(void)
+{
+   Uint16 src[] = { 'A', 0xe9, 0x20ac, 0xfffd, 0 };
+   char *utf8 = nano_strduputf8from16(src);
+   check(strcmp(utf8, "A\xc3\xa9\xe2\x82\xac\xef\xbf\xbd") == 0,
+         "nano_strduputf8from16", 0);
+
+   Uint16 *back = nano_strdup16fromutf8(utf8);
+   check(back && memcmp(back, src, sizeof(src)) == 0,
+         "nano_strdup16fromutf8", 0);
+   free(utf8);
+   free(back);
+}